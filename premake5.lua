@@ -16,9 +16,11 @@ CreateWorkspace({name = "cvarsx"})
 		IncludeSDKCommon()
 		IncludeSDKTier0()
 		IncludeSDKTier1()
+		IncludeDetouring()
 
 	CreateProject({serverside = false})
 		IncludeLuaShared()
 		IncludeSDKCommon()
 		IncludeSDKTier0()
 		IncludeSDKTier1()
+		IncludeDetouring()
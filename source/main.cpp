@@ -2,13 +2,34 @@
 #include <GarrysMod/Lua/AutoReference.h>
 #include <GarrysMod/Interfaces.hpp>
 #include <lua.hpp>
+#include <detouring/classproxy.hpp>
 #include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <cctype>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <functional>
+#include <utility>
+#include <memory>
 #include <hackedconvar.h>
+#include <pointermap.h>
+#include <tier0/icommandline.h>
+#include <tier1/checksum_crc.h>
 
 #if defined CVARSX_SERVER
 
 #include <eiface.h>
+#include <edict.h>
+#include <basehandle.h>
 #include <inetchannel.h>
+#include <game/server/iplayerinfo.h>
 
 #elif defined CVARSX_CLIENT
 
@@ -16,6 +37,59 @@
 
 #endif
 
+#if defined _WIN32
+
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+
+#include <windows.h>
+
+#else
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#endif
+
+namespace binding
+{
+
+struct Function
+{
+	const char *name;
+	GarrysMod::Lua::CFunc function;
+};
+
+// Sets every function of the list as a field of the table on top of the stack.
+template<size_t Size>
+inline void Register( GarrysMod::Lua::ILuaBase *LUA, const Function ( &functions )[Size] )
+{
+	for( const Function &function : functions )
+	{
+		LUA->PushCFunction( function.function );
+		LUA->SetField( -2, function.name );
+	}
+}
+
+template<size_t Size>
+inline void Unregister( GarrysMod::Lua::ILuaBase *LUA, const Function ( &functions )[Size] )
+{
+	for( const Function &function : functions )
+	{
+		LUA->PushNil( );
+		LUA->SetField( -2, function.name );
+	}
+}
+
+}
+
 namespace global
 {
 
@@ -39,6 +113,84 @@ typedef IVEngineClient IVEngine;
 static ICvar *icvar = nullptr;
 static IVEngine *ivengine = nullptr;
 
+#if defined CVARSX_SERVER
+
+static SourceSDK::FactoryLoader server_loader( "server", false, false, "garrysmod/bin/" );
+static IPlayerInfoManager *playerinfo = nullptr;
+static CGlobalVars *globals = nullptr;
+
+#endif
+
+// Bumped every time a ConCommandBase is registered or unregistered.
+static uint64_t generation = 0;
+
+// Called with every root ConVar about to be unregistered, so state keyed by its pointer can be
+// dropped before the memory is freed or reused.
+typedef void ( *UnregisterCallback )( ConVar *convar );
+static std::vector<UnregisterCallback> unregister_callbacks;
+
+static void NotifyUnregister( ConCommandBase *base )
+{
+	if( base == nullptr || base->IsCommand( ) )
+		return;
+
+	ConVar *convar = static_cast<ConVar *>( base );
+	if( convar->m_pParent != convar )
+		return;
+
+	for( UnregisterCallback callback : unregister_callbacks )
+		callback( convar );
+}
+
+class CvarProxy : public Detouring::ClassProxy<ICvar, CvarProxy>
+{
+public:
+	CvarProxy( ICvar *icvar )
+	{
+		Initialize( icvar );
+		Hook( &ICvar::RegisterConCommand, &CvarProxy::RegisterConCommand );
+		Hook( &ICvar::UnregisterConCommand, &CvarProxy::UnregisterConCommand );
+		Hook( &ICvar::UnregisterConCommands, &CvarProxy::UnregisterConCommands );
+	}
+
+	~CvarProxy( )
+	{
+		UnHook( &ICvar::RegisterConCommand );
+		UnHook( &ICvar::UnregisterConCommand );
+		UnHook( &ICvar::UnregisterConCommands );
+	}
+
+	virtual void RegisterConCommand( ConCommandBase *base )
+	{
+		Call( &ICvar::RegisterConCommand, base );
+		++generation;
+	}
+
+	virtual void UnregisterConCommand( ConCommandBase *base )
+	{
+		NotifyUnregister( base );
+		Call( &ICvar::UnregisterConCommand, base );
+		++generation;
+	}
+
+	virtual void UnregisterConCommands( CVarDLLIdentifier_t id )
+	{
+		std::vector<ConCommandBase *> removed;
+		ICvar::Iterator iter( icvar );
+		for( iter.SetFirst( ); iter.IsValid( ); iter.Next( ) )
+			if( iter.Get( )->GetDLLIdentifier( ) == id )
+				removed.push_back( iter.Get( ) );
+
+		for( ConCommandBase *base : removed )
+			NotifyUnregister( base );
+
+		Call( &ICvar::UnregisterConCommands, id );
+		++generation;
+	}
+};
+
+static CvarProxy *icvar_proxy = nullptr;
+
 static void Initialize( GarrysMod::Lua::ILuaBase *LUA )
 {
 	icvar = icvar_loader.GetInterface<ICvar>( CVAR_INTERFACE_VERSION );
@@ -48,568 +200,3952 @@ static void Initialize( GarrysMod::Lua::ILuaBase *LUA )
 	ivengine = engine_loader.GetInterface<IVEngine>( ivengine_name );
 	if( ivengine == nullptr )
 		LUA->ThrowError( "IVEngineServer/Client not initialized. Critical error." );
+
+#if defined CVARSX_SERVER
+
+	playerinfo = server_loader.GetInterface<IPlayerInfoManager>( INTERFACEVERSION_PLAYERINFOMANAGER );
+	if( playerinfo == nullptr )
+		LUA->ThrowError( "IPlayerInfoManager not initialized. Critical error." );
+
+	globals = playerinfo->GetGlobalVars( );
+
+#endif
+
+	icvar_proxy = new CvarProxy( icvar );
 }
 
+static void Deinitialize( GarrysMod::Lua::ILuaBase * )
+{
+	delete icvar_proxy;
+	icvar_proxy = nullptr;
+
+	unregister_callbacks.clear( );
 }
 
-namespace convar
+}
+
+namespace nameindex
 {
 
-struct Container
+struct Entry
 {
-	ConVar *cvar;
-	const char *name_original;
-	char name[64];
-	const char *help_original;
-	char help[256];
+	std::string key;
+	ConVar *convar;
 };
 
-static const char metaname[] = "convar";
-static int32_t metatype = -1;
-static const char invalid_error[] = "invalid convar";
-static const char table_name[] = "convars_objects";
+// Sorted by lowercase name, so prefix queries are a binary search plus a scan over the matches.
+static std::vector<Entry> entries;
+static uint64_t generation = 0;
+static bool dirty = true;
 
-inline void CheckType( GarrysMod::Lua::ILuaBase *LUA, int32_t index )
+static std::vector<ConVar *> convars;
+static uint64_t convars_generation = 0;
+static bool convars_valid = false;
+
+inline std::string ToLower( const char *str )
 {
-	if( !LUA->IsType( index, metatype ) )
-		LUA->TypeError( index, metaname );
+	std::string lower( str );
+	for( char &c : lower )
+		c = static_cast<char>( std::tolower( static_cast<unsigned char>( c ) ) );
+
+	return lower;
 }
 
-inline Container *GetUserdata( GarrysMod::Lua::ILuaBase *LUA, int index )
+inline void Invalidate( )
 {
-	return LUA->GetUserType<Container>( index, metatype );
+	dirty = true;
 }
 
-static ConVar *Get( GarrysMod::Lua::ILuaBase *LUA, int32_t index )
+// Every registered ConVar, in ICvar iteration order.
+static const std::vector<ConVar *> &GetConVars( )
 {
-	CheckType( LUA, index );
-	ConVar *convar = LUA->GetUserType<Container>( index, metatype )->cvar;
-	if( convar == nullptr )
-		LUA->ArgError( index, invalid_error );
+	if( convars_valid && convars_generation == global::generation )
+		return convars;
 
-	return convar;
-}
+	convars.clear( );
 
-inline void Push( GarrysMod::Lua::ILuaBase *LUA, ConVar *convar )
-{
-	if( convar == nullptr )
+	ICvar::Iterator iter( global::icvar );
+	for( iter.SetFirst( ); iter.IsValid( ); iter.Next( ) )
 	{
-		LUA->PushNil( );
-		return;
+		ConVar *convar = static_cast<ConVar *>( iter.Get( ) );
+		if( !convar->IsCommand( ) )
+			convars.push_back( convar );
 	}
 
-	LUA->GetField( GarrysMod::Lua::INDEX_REGISTRY, table_name );
-	LUA->PushUserdata( convar );
-	LUA->GetTable( -2 );
-	if( LUA->IsType( -1, metatype ) )
-	{
-		LUA->Remove( -2 );
+	convars_generation = global::generation;
+	convars_valid = true;
+	return convars;
+}
+
+static void Refresh( )
+{
+	if( !dirty && generation == global::generation )
 		return;
-	}
 
-	LUA->Pop( 1 );
+	const std::vector<ConVar *> &all = GetConVars( );
+	entries.clear( );
+	entries.reserve( all.size( ) );
+	for( ConVar *convar : all )
+		entries.push_back( { ToLower( convar->GetName( ) ), convar } );
 
-	Container *udata = LUA->NewUserType<Container>( metatype );
-	udata->cvar = convar;
-	udata->name_original = convar->m_pszName;
-	udata->help_original = convar->m_pszHelpString;
+	std::sort( entries.begin( ), entries.end( ), []( const Entry &a, const Entry &b )
+	{
+		return a.key < b.key;
+	} );
 
-	LUA->PushMetaTable( metatype );
-	LUA->SetMetaTable( -2 );
+	generation = global::generation;
+	dirty = false;
+}
 
-	LUA->CreateTable( );
-	LUA->SetFEnv( -2 );
+// Supports '*' (any sequence) and '?' (any character). Both strings must already be lowercase.
+static bool Glob( const char *pattern, const char *str )
+{
+	const char *star = nullptr, *backtrack = nullptr;
+	while( *str != '\0' )
+	{
+		if( *pattern == '*' )
+		{
+			star = ++pattern;
+			backtrack = str;
+		}
+		else if( *pattern == '?' || *pattern == *str )
+		{
+			++pattern;
+			++str;
+		}
+		else if( star != nullptr )
+		{
+			pattern = star;
+			str = ++backtrack;
+		}
+		else
+		{
+			return false;
+		}
+	}
 
-	LUA->PushUserdata( convar );
-	LUA->Push( -2 );
-	LUA->SetTable( -4 );
-	LUA->Remove( -2 );
+	while( *pattern == '*' )
+		++pattern;
+
+	return *pattern == '\0';
 }
 
-inline ConVar *Destroy( GarrysMod::Lua::ILuaBase *LUA, int32_t index )
+// Patterns without wildcards are treated as a prefix, which is what autocompletion wants.
+template<typename Callback>
+static void Find( const char *pattern, size_t limit, Callback callback )
 {
-	Container *udata = GetUserdata( LUA, 1 );
-	ConVar *convar = udata->cvar;
-	if( convar == nullptr )
-		return nullptr;
+	Refresh( );
 
-	LUA->GetField( GarrysMod::Lua::INDEX_REGISTRY, table_name );
-	LUA->PushUserdata( convar );
-	LUA->PushNil( );
-	LUA->SetTable( -3 );
-	LUA->Pop( 1 );
+	const std::string lower = ToLower( pattern );
+	const size_t wildcard = lower.find_first_of( "*?" );
+	const bool is_glob = wildcard != std::string::npos;
+	const std::string prefix = lower.substr( 0, wildcard );
 
-	convar->m_pszName = udata->name_original;
-	convar->m_pszHelpString = udata->help_original;
-	udata->cvar = nullptr;
+	auto it = std::lower_bound( entries.begin( ), entries.end( ), prefix,
+		[]( const Entry &entry, const std::string &key )
+	{
+		return entry.key < key;
+	} );
 
-	return convar;
+	size_t found = 0;
+	for( ; it != entries.end( ) && it->key.compare( 0, prefix.size( ), prefix ) == 0; ++it )
+	{
+		if( is_glob && !Glob( lower.c_str( ), it->key.c_str( ) ) )
+			continue;
+
+		callback( it->convar );
+		if( ++found == limit )
+			break;
+	}
 }
 
-LUA_FUNCTION_STATIC( gc )
+static void Deinitialize( )
 {
-	if( !LUA->IsType( 1, metatype ) )
-		return 0;
+	entries.clear( );
+	entries.shrink_to_fit( );
+	dirty = true;
 
-	Destroy( LUA, 1 );
-	return 0;
+	convars.clear( );
+	convars.shrink_to_fit( );
+	convars_valid = false;
 }
 
-LUA_FUNCTION_STATIC( eq )
-{
-	LUA->PushBool( Get( LUA, 1 ) == Get( LUA, 2 ) );
-	return 1;
 }
 
-LUA_FUNCTION_STATIC( tostring )
+namespace changes
 {
-	LUA->PushFormattedString( "%s: %p", metaname, Get( LUA, 1 ) );
-	return 1;
-}
 
-LUA_FUNCTION_STATIC( index )
+struct Change
 {
-	LUA->GetMetaTable( 1 );
-	LUA->Push( 2 );
-	LUA->RawGet( -2 );
-	if( !LUA->IsType( -1, GarrysMod::Lua::Type::NIL ) )
-		return 1;
+	std::string old_value;
+	float old_float;
+};
 
-	LUA->Pop( 2 );
+// Counts every convar change, so native caches of convar values can tell they went stale.
+static uint64_t count = 0;
 
-	LUA->GetFEnv( 1 );
-	LUA->Push( 2 );
-	LUA->RawGet( -2 );
-	return 1;
+// Root convars something subscribed to, with the amount of subscriptions.
+static std::unordered_map<ConVar *, size_t> subscriptions;
+
+// Changes of subscribed convars since the last tick, keeping the value from before the first one.
+static std::unordered_map<ConVar *, Change> pending;
+
+static void OnChanged( IConVar *var, const char *old_value, float old_float )
+{
+	++count;
+
+	ConVar *convar = static_cast<ConVar *>( var )->m_pParent;
+	if( subscriptions.find( convar ) == subscriptions.end( ) )
+		return;
+
+	pending.emplace( convar, Change { old_value != nullptr ? old_value : "", old_float } );
 }
 
-LUA_FUNCTION_STATIC( newindex )
+// Hands over the changes accumulated since the last call.
+static std::unordered_map<ConVar *, Change> Take( )
 {
-	LUA->GetFEnv( 1 );
-	LUA->Push( 2 );
-	LUA->Push( 3 );
-	LUA->RawSet( -3 );
-	return 0;
+	std::unordered_map<ConVar *, Change> taken;
+	taken.swap( pending );
+	return taken;
 }
 
-LUA_FUNCTION_STATIC( SetValue )
+inline void Subscribe( ConVar *convar )
 {
-	ConVar *convar = Get( LUA, 1 );
+	++subscriptions[convar->m_pParent];
+}
 
-	switch( LUA->GetType( 2 ) )
+inline void Unsubscribe( ConVar *convar )
+{
+	auto it = subscriptions.find( convar->m_pParent );
+	if( it != subscriptions.end( ) && --it->second == 0 )
 	{
-		case GarrysMod::Lua::Type::NUMBER:
-			convar->SetValue( static_cast<float>( LUA->GetNumber( 2 ) ) );
-			break;
-
-		case GarrysMod::Lua::Type::BOOL:
-			convar->SetValue( LUA->GetBool( 2 ) ? 1 : 0 );
-			break;
-
-		case GarrysMod::Lua::Type::STRING:
-			convar->SetValue( LUA->GetString( 2 ) );
-			break;
-
-		default:
-			LUA->ThrowError( "argument #2 is invalid (type should be number, boolean or string)" );
+		subscriptions.erase( it );
+		pending.erase( convar->m_pParent );
 	}
+}
 
-	return 0;
+static void OnUnregister( ConVar *convar )
+{
+	subscriptions.erase( convar );
+	pending.erase( convar );
 }
 
-LUA_FUNCTION_STATIC( GetBool )
+static void Initialize( )
 {
-	LUA->PushBool( Get( LUA, 1 )->GetBool( ) );
-	return 1;
+	global::icvar->InstallGlobalChangeCallback( OnChanged );
+	global::unregister_callbacks.push_back( OnUnregister );
 }
 
-LUA_FUNCTION_STATIC( GetDefault )
+static void Deinitialize( )
 {
+	global::icvar->RemoveGlobalChangeCallback( OnChanged );
+	subscriptions.clear( );
+	pending.clear( );
+}
 
-	LUA->PushString( Get( LUA, 1 )->GetDefault( ) );
-	return 1;
 }
 
-LUA_FUNCTION_STATIC( GetFloat )
+namespace stringpool
 {
-	LUA->PushNumber( Get( LUA, 1 )->GetFloat( ) );
-	return 1;
-}
 
-LUA_FUNCTION_STATIC( GetInt )
+// Deduplicated, module-owned strings of any length. Set nodes never move, so the pointers
+// handed out stay valid until the module is unloaded.
+static std::unordered_set<std::string> pool;
+
+inline const char *Intern( const char *str )
 {
-	LUA->PushNumber( Get( LUA, 1 )->GetInt( ) );
-	return 1;
+	return pool.insert( str ).first->c_str( );
 }
 
-LUA_FUNCTION_STATIC( GetName )
-{
-	LUA->PushString( Get( LUA, 1 )->GetName( ) );
-	return 1;
 }
 
-LUA_FUNCTION_STATIC( SetName )
+namespace convar
 {
-	Container *udata = GetUserdata( LUA, 1 );
-	ConVar *convar = udata->cvar;
-	if( convar == nullptr )
-		LUA->ThrowError( invalid_error );
 
-	V_strncpy( udata->name, LUA->CheckString( 2 ), sizeof( udata->name ) );
-	convar->m_pszName = udata->name;
+// Original strings of a convar whose name or help text was overridden.
+struct Override
+{
+	const char *name_original;
+	const char *help_original;
+};
+
+// Lua string last pushed for a convar string, reused while the key it was pushed with holds.
+struct CachedString
+{
+	const char *pointer;
+	int32_t length;
+	uint64_t change;
+	int32_t reference;
+};
 
-	return 0;
-}
+struct StringCache
+{
+	CachedString value;
+	CachedString default_value;
+	CachedString help;
+};
 
-LUA_FUNCTION_STATIC( GetString )
+// Handles only pay for an override record when SetName or SetHelpText is used, and for a string
+// cache when GetString, GetDefault or GetHelpText is used.
+struct Container
 {
-	LUA->PushString( Get( LUA, 1 )->GetString( ) );
-	return 1;
+	ConVar *cvar;
+	Override *override;
+	StringCache *strings;
+};
+
+// Override records are recycled through a free list instead of going back to the heap.
+static std::deque<Override> overrides;
+static std::vector<Override *> free_overrides;
+
+inline Override *AcquireOverride( ConVar *convar )
+{
+	Override *record = nullptr;
+	if( !free_overrides.empty( ) )
+	{
+		record = free_overrides.back( );
+		free_overrides.pop_back( );
+	}
+	else
+	{
+		overrides.emplace_back( );
+		record = &overrides.back( );
+	}
+
+	record->name_original = convar->m_pszName;
+	record->help_original = convar->m_pszHelpString;
+	return record;
 }
 
-LUA_FUNCTION_STATIC( SetFlags )
+inline void ReleaseOverride( ConVar *convar, Override *record )
 {
-	Get( LUA, 1 )->m_nFlags = static_cast<int32_t>( LUA->CheckNumber( 2 ) );
-	return 0;
+	convar->m_pszName = record->name_original;
+	convar->m_pszHelpString = record->help_original;
+	free_overrides.push_back( record );
 }
 
-LUA_FUNCTION_STATIC( GetFlags )
-{
-	LUA->PushNumber( Get( LUA, 1 )->m_nFlags );
-	return 1;
+// String caches are recycled the same way as override records.
+static std::deque<StringCache> string_caches;
+static std::vector<StringCache *> free_string_caches;
+
+inline StringCache *AcquireStringCache( )
+{
+	StringCache *cache = nullptr;
+	if( !free_string_caches.empty( ) )
+	{
+		cache = free_string_caches.back( );
+		free_string_caches.pop_back( );
+	}
+	else
+	{
+		string_caches.emplace_back( );
+		cache = &string_caches.back( );
+	}
+
+	const CachedString empty = { nullptr, 0, 0, -1 };
+	cache->value = empty;
+	cache->default_value = empty;
+	cache->help = empty;
+	return cache;
+}
+
+inline void ReleaseStringCache( GarrysMod::Lua::ILuaBase *LUA, StringCache *cache )
+{
+	for( CachedString *cached : { &cache->value, &cache->default_value, &cache->help } )
+		if( cached->reference != -1 )
+			LUA->ReferenceFree( cached->reference );
+
+	free_string_caches.push_back( cache );
+}
+
+// Pushes str through the cache entry, only creating a new Lua string when the key changed.
+static void PushCached(
+	GarrysMod::Lua::ILuaBase *LUA,
+	CachedString &cached,
+	const char *str,
+	int32_t length,
+	uint64_t change
+)
+{
+	if( cached.reference != -1 )
+	{
+		if( cached.pointer == str && cached.length == length && cached.change == change )
+		{
+			LUA->ReferencePush( cached.reference );
+			return;
+		}
+
+		LUA->ReferenceFree( cached.reference );
+	}
+
+	LUA->PushString( str );
+	LUA->Push( -1 );
+	cached.reference = LUA->ReferenceCreate( );
+	cached.pointer = str;
+	cached.length = length;
+	cached.change = change;
+}
+
+static const char metaname[] = "convar";
+static int32_t metatype = -1;
+static const char invalid_error[] = "invalid convar";
+
+// Cached handle of a convar. The userdata itself lives in a slot of a weak table, so it can
+// still be collected while cached, unless it was pinned through a strong reference.
+struct Handle
+{
+	Container *udata;
+	int32_t slot;
+	int32_t pin;
+};
+
+static PointerMap<ConVar, Handle> handles;
+static GarrysMod::Lua::AutoReference weak_handles;
+static std::vector<int32_t> free_slots;
+static int32_t next_slot = 1;
+
+// Amount of handles that weren't collected yet.
+static size_t alive = 0;
+
+// Shared by every handle until a field is first assigned to it, must never be written to.
+static int32_t empty_environment = -1;
+
+// Handles without fields of their own use metatype, whose __index is the metatable itself, so
+// method lookups never leave Lua. Once a field is assigned, a handle switches to this metatable,
+// whose __index checks the methods first and only falls back to the environment on a miss.
+static int32_t fields_metatable = -1;
+
+inline void CheckType( GarrysMod::Lua::ILuaBase *LUA, int32_t index )
+{
+	if( !LUA->IsType( index, metatype ) )
+		LUA->TypeError( index, metaname );
+}
+
+inline Container *GetUserdata( GarrysMod::Lua::ILuaBase *LUA, int index )
+{
+	return LUA->GetUserType<Container>( index, metatype );
+}
+
+static ConVar *Get( GarrysMod::Lua::ILuaBase *LUA, int32_t index )
+{
+	CheckType( LUA, index );
+	ConVar *convar = LUA->GetUserType<Container>( index, metatype )->cvar;
+	if( convar == nullptr )
+		LUA->ArgError( index, invalid_error );
+
+	return convar;
+}
+
+// Drops the cached handle of a convar, which is the only place its slot goes back to the free
+// list. The userdata is left untouched apart from its override record, so its __gc finds no
+// cached handle for it and does nothing else.
+static void Forget( GarrysMod::Lua::ILuaBase *LUA, ConVar *convar, Handle *handle )
+{
+	weak_handles.Push( );
+	LUA->PushNumber( handle->slot );
+	LUA->PushNil( );
+	LUA->RawSet( -3 );
+	LUA->Pop( 1 );
+
+	free_slots.push_back( handle->slot );
+
+	if( handle->pin != -1 )
+		LUA->ReferenceFree( handle->pin );
+
+	Container *udata = handle->udata;
+	if( udata->override != nullptr )
+	{
+		ReleaseOverride( convar, udata->override );
+		udata->override = nullptr;
+	}
+
+	handles.Erase( convar );
+}
+
+inline void Push( GarrysMod::Lua::ILuaBase *LUA, ConVar *convar )
+{
+	if( convar == nullptr )
+	{
+		LUA->PushNil( );
+		return;
+	}
+
+	Handle *handle = handles.Find( convar );
+	if( handle != nullptr )
+	{
+		weak_handles.Push( );
+		LUA->PushNumber( handle->slot );
+		LUA->RawGet( -2 );
+		LUA->Remove( -2 );
+		if( LUA->IsType( -1, metatype ) )
+			return;
+
+		LUA->Pop( 1 );
+
+		// Collected but not finalized yet. Forget it before allocating, since that may run its
+		// __gc, which must not find it still cached.
+		Forget( LUA, convar, handle );
+	}
+
+	int32_t slot = next_slot;
+	if( !free_slots.empty( ) )
+	{
+		slot = free_slots.back( );
+		free_slots.pop_back( );
+	}
+	else
+	{
+		++next_slot;
+	}
+
+	Container *udata = LUA->NewUserType<Container>( metatype );
+	++alive;
+	udata->cvar = convar;
+	udata->override = nullptr;
+	udata->strings = nullptr;
+
+	LUA->PushMetaTable( metatype );
+	LUA->SetMetaTable( -2 );
+
+	LUA->ReferencePush( empty_environment );
+	LUA->SetFEnv( -2 );
+
+	weak_handles.Push( );
+	LUA->PushNumber( slot );
+	LUA->Push( -3 );
+	LUA->RawSet( -3 );
+	LUA->Pop( 1 );
+
+	handles.Insert( convar, { udata, slot, -1 } );
+}
+
+inline ConVar *Destroy( GarrysMod::Lua::ILuaBase *LUA, int32_t index )
+{
+	Container *udata = GetUserdata( LUA, 1 );
+	ConVar *convar = udata->cvar;
+	if( convar == nullptr )
+		return nullptr;
+
+	udata->cvar = nullptr;
+
+	// The cache is weak, so a newer handle might already be cached for this convar.
+	Handle *handle = handles.Find( convar );
+	if( handle == nullptr || handle->udata != udata )
+		return convar;
+
+	Forget( LUA, convar, handle );
+	return convar;
+}
+
+// Gives the handle an override record. Such handles must outlive every reference from Lua,
+// since restoring the original strings happens when they're collected, so they get pinned.
+inline void Pin( GarrysMod::Lua::ILuaBase *LUA, Container *udata, int32_t index )
+{
+	if( udata->override != nullptr )
+		return;
+
+	ConVar *convar = udata->cvar;
+	udata->override = AcquireOverride( convar );
+
+	Handle *handle = handles.Find( convar );
+	if( handle != nullptr && handle->udata == udata && handle->pin == -1 )
+	{
+		LUA->Push( index );
+		handle->pin = LUA->ReferenceCreate( );
+	}
+}
+
+LUA_FUNCTION_STATIC( gc )
+{
+	if( !LUA->IsType( 1, metatype ) )
+		return 0;
+
+	Destroy( LUA, 1 );
+
+	Container *udata = GetUserdata( LUA, 1 );
+	if( udata->strings != nullptr )
+	{
+		ReleaseStringCache( LUA, udata->strings );
+		udata->strings = nullptr;
+	}
+
+	--alive;
+	return 0;
+}
+
+LUA_FUNCTION_STATIC( eq )
+{
+	LUA->PushBool( Get( LUA, 1 ) == Get( LUA, 2 ) );
+	return 1;
+}
+
+LUA_FUNCTION_STATIC( tostring )
+{
+	LUA->PushFormattedString( "%s: %p", metaname, Get( LUA, 1 ) );
+	return 1;
+}
+
+// Only used by handles with fields of their own, see fields_metatable.
+LUA_FUNCTION_STATIC( index )
+{
+	LUA->Push( lua_upvalueindex( 1 ) );
+	LUA->Push( 2 );
+	LUA->RawGet( -2 );
+	if( !LUA->IsType( -1, GarrysMod::Lua::Type::NIL ) )
+		return 1;
+
+	LUA->Pop( 2 );
+
+	LUA->GetFEnv( 1 );
+	LUA->Push( 2 );
+	LUA->RawGet( -2 );
+	return 1;
+}
+
+LUA_FUNCTION_STATIC( newindex )
+{
+	LUA->GetFEnv( 1 );
+	LUA->ReferencePush( empty_environment );
+	const bool shared = LUA->RawEqual( -1, -2 );
+	LUA->Pop( 1 );
+	if( shared )
+	{
+		LUA->Pop( 1 );
+		LUA->CreateTable( );
+		LUA->Push( -1 );
+		LUA->SetFEnv( 1 );
+
+		LUA->ReferencePush( fields_metatable );
+		LUA->SetMetaTable( 1 );
+	}
+
+	LUA->Push( 2 );
+	LUA->Push( 3 );
+	LUA->RawSet( -3 );
+	return 0;
+}
+
+enum class Assignment
+{
+	Changed,
+	Unchanged,
+	Invalid
+};
+
+// Whether the convar string holds the number, either in the form ConVar::SetValue formats it
+// with or as any other numeric literal of the same value. Strings like "abc" have a float value
+// of 0 but don't hold the number 0.
+static bool HoldsNumber( const ConVar *parent, const char *formatted, float value )
+{
+	const char *str = parent->m_pszString;
+	if( str == nullptr )
+		return false;
+
+	if( std::strcmp( str, formatted ) == 0 )
+		return true;
+
+	char *end = nullptr;
+	const double parsed = std::strtod( str, &end );
+	return end != str && *end == '\0' && static_cast<float>( parsed ) == value;
+}
+
+// Sets the convar to the number, boolean or string at index. With only_changed, the value is
+// compared against the current one first and left alone (firing no callbacks) when equal.
+static Assignment Assign(
+	GarrysMod::Lua::ILuaBase *LUA,
+	ConVar *convar,
+	int32_t index,
+	bool only_changed
+)
+{
+	const ConVar *parent = convar->m_pParent;
+	switch( LUA->GetType( index ) )
+	{
+		case GarrysMod::Lua::Type::NUMBER:
+		{
+			const float value = static_cast<float>( LUA->GetNumber( index ) );
+			if( !only_changed || parent->m_fValue != value )
+			{
+				convar->SetValue( value );
+				return Assignment::Changed;
+			}
+
+			char formatted[32];
+			std::snprintf( formatted, sizeof( formatted ), "%f", value );
+			if( HoldsNumber( parent, formatted, value ) )
+				return Assignment::Unchanged;
+
+			// SetValue( float ) ignores values equal to m_fValue, so write the string instead.
+			convar->SetValue( formatted );
+			return Assignment::Changed;
+		}
+
+		case GarrysMod::Lua::Type::BOOL:
+		{
+			const int value = LUA->GetBool( index ) ? 1 : 0;
+			if( !only_changed || parent->m_nValue != value || parent->m_fValue != value )
+			{
+				convar->SetValue( value );
+				return Assignment::Changed;
+			}
+
+			char formatted[4];
+			std::snprintf( formatted, sizeof( formatted ), "%d", value );
+			if( HoldsNumber( parent, formatted, static_cast<float>( value ) ) )
+				return Assignment::Unchanged;
+
+			convar->SetValue( formatted );
+			return Assignment::Changed;
+		}
+
+		case GarrysMod::Lua::Type::STRING:
+		{
+			const char *value = LUA->GetString( index );
+			if( only_changed && parent->m_pszString != nullptr &&
+				std::strcmp( parent->m_pszString, value ) == 0 )
+				return Assignment::Unchanged;
+
+			convar->SetValue( value );
+			return Assignment::Changed;
+		}
+
+		default:
+			return Assignment::Invalid;
+	}
+}
+
+LUA_FUNCTION_STATIC( SetValue )
+{
+	ConVar *convar = Get( LUA, 1 );
+	if( Assign( LUA, convar, 2, false ) == Assignment::Invalid )
+		LUA->ThrowError( "argument #2 is invalid (type should be number, boolean or string)" );
+
+	return 0;
+}
+
+LUA_FUNCTION_STATIC( GetBool )
+{
+	LUA->PushBool( Get( LUA, 1 )->GetBool( ) );
+	return 1;
+}
+
+// Helper for the getters of cached strings, throws like Get when the handle is invalid.
+static StringCache *GetStringCache( GarrysMod::Lua::ILuaBase *LUA, int32_t index, ConVar *&convar )
+{
+	convar = Get( LUA, index );
+
+	Container *udata = GetUserdata( LUA, index );
+	if( udata->strings == nullptr )
+		udata->strings = AcquireStringCache( );
+
+	return udata->strings;
+}
+
+LUA_FUNCTION_STATIC( GetDefault )
+{
+	ConVar *convar = nullptr;
+	StringCache *cache = GetStringCache( LUA, 1, convar );
+	const char *str = convar->GetDefault( );
+	PushCached( LUA, cache->default_value, str, 0, 0 );
+	return 1;
+}
+
+LUA_FUNCTION_STATIC( GetFloat )
+{
+	LUA->PushNumber( Get( LUA, 1 )->GetFloat( ) );
+	return 1;
+}
+
+LUA_FUNCTION_STATIC( GetInt )
+{
+	LUA->PushNumber( Get( LUA, 1 )->GetInt( ) );
+	return 1;
+}
+
+// Returns the string, float, int and bool values at once.
+LUA_FUNCTION_STATIC( GetValues )
+{
+	ConVar *convar = Get( LUA, 1 );
+	LUA->PushString( convar->GetString( ) );
+	LUA->PushNumber( convar->GetFloat( ) );
+	LUA->PushNumber( convar->GetInt( ) );
+	LUA->PushBool( convar->GetBool( ) );
+	return 4;
+}
+
+LUA_FUNCTION_STATIC( GetName )
+{
+	LUA->PushString( Get( LUA, 1 )->GetName( ) );
+	return 1;
+}
+
+LUA_FUNCTION_STATIC( SetName )
+{
+	Container *udata = GetUserdata( LUA, 1 );
+	ConVar *convar = udata->cvar;
+	if( convar == nullptr )
+		LUA->ThrowError( invalid_error );
+
+	const char *name = stringpool::Intern( LUA->CheckString( 2 ) );
+	Pin( LUA, udata, 1 );
+	convar->m_pszName = name;
+	nameindex::Invalidate( );
+
+	return 0;
+}
+
+// The string buffer is reused when the new value fits, so changes::count is part of the key.
+LUA_FUNCTION_STATIC( GetString )
+{
+	ConVar *convar = nullptr;
+	StringCache *cache = GetStringCache( LUA, 1, convar );
+	const char *str = convar->GetString( );
+	PushCached( LUA, cache->value, str, convar->m_pParent->m_StringLength, changes::count );
+	return 1;
+}
+
+LUA_FUNCTION_STATIC( SetFlags )
+{
+	Get( LUA, 1 )->m_nFlags = static_cast<int32_t>( LUA->CheckNumber( 2 ) );
+	return 0;
+}
+
+LUA_FUNCTION_STATIC( GetFlags )
+{
+	LUA->PushNumber( Get( LUA, 1 )->m_nFlags );
+	return 1;
+}
+
+LUA_FUNCTION_STATIC( HasFlag )
+{
+	LUA->Push( Get( LUA, 1 )->IsFlagSet( static_cast<int32_t>( LUA->CheckNumber( 2 ) ) ) );
+	return 1;
+}
+
+LUA_FUNCTION_STATIC( SetHelpText )
+{
+	Container *udata = GetUserdata( LUA, 1 );
+	ConVar *convar = udata->cvar;
+	if( convar == nullptr )
+		LUA->ThrowError( invalid_error );
+
+	const char *help = stringpool::Intern( LUA->CheckString( 2 ) );
+	Pin( LUA, udata, 1 );
+	convar->m_pszHelpString = help;
+
+	return 0;
+}
+
+LUA_FUNCTION_STATIC( GetHelpText )
+{
+	ConVar *convar = nullptr;
+	StringCache *cache = GetStringCache( LUA, 1, convar );
+	const char *str = convar->GetHelpText( );
+	PushCached( LUA, cache->help, str, 0, 0 );
+	return 1;
+}
+
+LUA_FUNCTION_STATIC( Revert )
+{
+	Get( LUA, 1 )->Revert( );
+	return 0;
+}
+
+LUA_FUNCTION_STATIC( GetMin )
+{
+	float min = 0.0f;
+	if( !Get( LUA, 1 )->GetMin( min ) )
+		return 0;
+
+	LUA->PushNumber( min );
+	return 1;
+}
+
+LUA_FUNCTION_STATIC( SetMin )
+{
+	Get( LUA, 1 )->m_fMinVal = static_cast<float>( LUA->CheckNumber( 2 ) );
+	return 0;
+}
+
+LUA_FUNCTION_STATIC( GetMax )
+{
+	float max = 0.0f;
+	if( !Get( LUA, 1 )->GetMax( max ) )
+		return 0;
+
+	LUA->PushNumber( max );
+	return 1;
+}
+
+LUA_FUNCTION_STATIC( SetMax )
+{
+	Get( LUA, 1 )->m_fMaxVal = static_cast<float>( LUA->CheckNumber( 2 ) );
+	return 0;
+}
+
+LUA_FUNCTION_STATIC( Remove )
+{
+	CheckType( LUA, 1 );
+	global::icvar->UnregisterConCommand( Destroy( LUA, 1 ) );
+	return 0;
+}
+
+// Metamethods are shared between metatype and fields_metatable, so __eq keeps working
+// between handles with and without fields.
+static const binding::Function metamethods[] = {
+	{ "__gc", gc },
+	{ "__tostring", tostring },
+	{ "__eq", eq },
+	{ "__newindex", newindex }
+};
+
+static const binding::Function methods[] = {
+	{ "SetValue", SetValue },
+	{ "GetBool", GetBool },
+	{ "GetDefault", GetDefault },
+	{ "GetFloat", GetFloat },
+	{ "GetInt", GetInt },
+	{ "GetName", GetName },
+	{ "SetName", SetName },
+	{ "GetString", GetString },
+	{ "GetValues", GetValues },
+	{ "SetFlags", SetFlags },
+	{ "GetFlags", GetFlags },
+	{ "HasFlag", HasFlag },
+	{ "SetHelpText", SetHelpText },
+	{ "GetHelpText", GetHelpText },
+	{ "Revert", Revert },
+	{ "GetMin", GetMin },
+	{ "SetMin", SetMin },
+	{ "GetMax", GetMax },
+	{ "SetMax", SetMax },
+	{ "Remove", Remove }
+};
+
+static void Initialize( GarrysMod::Lua::ILuaBase *LUA )
+{
+	weak_handles.Setup( LUA );
+	LUA->CreateTable( );
+	LUA->CreateTable( );
+	LUA->PushString( "v" );
+	LUA->SetField( -2, "__mode" );
+	LUA->SetMetaTable( -2 );
+	weak_handles.Create( );
+
+	LUA->CreateTable( );
+	empty_environment = LUA->ReferenceCreate( );
+
+	metatype = LUA->CreateMetaTable( metaname );
+	binding::Register( LUA, metamethods );
+	binding::Register( LUA, methods );
+
+	LUA->Push( -1 );
+	LUA->SetField( -2, "__index" );
+
+	// Copy everything, including MetaName and MetaID, so type checks see the same type.
+	LUA->CreateTable( );
+
+	LUA->PushNil( );
+	while( LUA->Next( -3 ) != 0 )
+	{
+		LUA->Push( -2 );
+		LUA->Push( -2 );
+		LUA->RawSet( -5 );
+		LUA->Pop( 1 );
+	}
+
+	LUA->Push( -2 );
+	LUA->PushCClosure( index, 1 );
+	LUA->SetField( -2, "__index" );
+
+	fields_metatable = LUA->ReferenceCreate( );
+
+	LUA->Pop( 1 );
+}
+
+static void Deinitialize( GarrysMod::Lua::ILuaBase *LUA )
+{
+	LUA->PushNil( );
+	LUA->SetField( GarrysMod::Lua::INDEX_REGISTRY, metaname );
+
+	// Handles that are still alive become invalid and give the convars their strings back.
+	handles.ForEach( [LUA]( const ConVar *, Handle &handle )
+	{
+		Container *udata = handle.udata;
+		if( udata->override != nullptr )
+		{
+			ReleaseOverride( udata->cvar, udata->override );
+			udata->override = nullptr;
+		}
+
+		if( udata->strings != nullptr )
+		{
+			ReleaseStringCache( LUA, udata->strings );
+			udata->strings = nullptr;
+		}
+
+		udata->cvar = nullptr;
+
+		if( handle.pin != -1 )
+			LUA->ReferenceFree( handle.pin );
+	} );
+
+	handles.Clear( );
+	free_slots.clear( );
+	next_slot = 1;
+	weak_handles.Free( );
+
+	LUA->ReferenceFree( empty_environment );
+	empty_environment = -1;
+
+	LUA->ReferenceFree( fields_metatable );
+	fields_metatable = -1;
+}
+
+}
+
+namespace watch
+{
+
+struct Watcher
+{
+	uint64_t id;
+	int32_t callback;
+	float epsilon;
+	float last;
+};
+
+static std::unordered_map<ConVar *, std::vector<Watcher>> watchers;
+static uint64_t next_id = 1;
+
+// Callbacks of watchers whose convar was unregistered, freed on the next tick.
+static std::vector<int32_t> orphaned_callbacks;
+
+static void OnUnregister( ConVar *convar )
+{
+	auto it = watchers.find( convar );
+	if( it == watchers.end( ) )
+		return;
+
+	for( const Watcher &watcher : it->second )
+		orphaned_callbacks.push_back( watcher.callback );
+
+	watchers.erase( it );
+}
+
+static void ReleaseOrphans( GarrysMod::Lua::ILuaBase *LUA )
+{
+	for( int32_t callback : orphaned_callbacks )
+		LUA->ReferenceFree( callback );
+
+	orphaned_callbacks.clear( );
+}
+
+static bool IsWatching( ConVar *convar, uint64_t id )
+{
+	auto it = watchers.find( convar );
+	if( it == watchers.end( ) )
+		return false;
+
+	for( const Watcher &watcher : it->second )
+		if( watcher.id == id )
+			return true;
+
+	return false;
+}
+
+// Calls fn( convar, old_value, new_value ) at most once per tick, with the value from before the
+// first change in that tick. With an epsilon, only numeric changes of at least epsilon since the
+// last reported value are reported, so oscillating convars can't cause callback storms.
+LUA_FUNCTION_STATIC( Watch )
+{
+	ConVar *cvar = convar::Get( LUA, 1 );
+	LUA->CheckType( 2, GarrysMod::Lua::Type::FUNCTION );
+
+	float epsilon = 0.0f;
+	if( !LUA->IsType( 3, GarrysMod::Lua::Type::NIL ) )
+		epsilon = static_cast<float>( LUA->CheckNumber( 3 ) );
+
+	LUA->Push( 2 );
+	const Watcher watcher = { next_id++, LUA->ReferenceCreate( ), epsilon, cvar->GetFloat( ) };
+	watchers[cvar->m_pParent].push_back( watcher );
+	changes::Subscribe( cvar );
+
+	LUA->PushNumber( static_cast<double>( watcher.id ) );
+	return 1;
+}
+
+LUA_FUNCTION_STATIC( Unwatch )
+{
+	ConVar *cvar = convar::Get( LUA, 1 );
+	const uint64_t id = static_cast<uint64_t>( LUA->CheckNumber( 2 ) );
+
+	auto it = watchers.find( cvar->m_pParent );
+	if( it == watchers.end( ) )
+		return 0;
+
+	std::vector<Watcher> &list = it->second;
+	for( auto watcher = list.begin( ); watcher != list.end( ); ++watcher )
+		if( watcher->id == id )
+		{
+			LUA->ReferenceFree( watcher->callback );
+			list.erase( watcher );
+			changes::Unsubscribe( cvar );
+			break;
+		}
+
+	if( list.empty( ) )
+		watchers.erase( it );
+
+	return 0;
+}
+
+static void Notify( GarrysMod::Lua::ILuaBase *LUA, ConVar *convar, const changes::Change &change )
+{
+	auto it = watchers.find( convar );
+	if( it == watchers.end( ) )
+		return;
+
+	const std::string value = convar->GetString( );
+	const float number = convar->GetFloat( );
+
+	// Callbacks may (un)watch, so work on a copy and check each watcher is still alive.
+	const std::vector<Watcher> list = it->second;
+	for( const Watcher &watcher : list )
+	{
+		if( watcher.epsilon > 0.0f ? std::fabs( number - watcher.last ) < watcher.epsilon : value == change.old_value )
+			continue;
+
+		if( !IsWatching( convar, watcher.id ) )
+			continue;
+
+		for( Watcher &live : watchers[convar] )
+			if( live.id == watcher.id )
+				live.last = number;
+
+		LUA->ReferencePush( watcher.callback );
+		convar::Push( LUA, convar );
+		LUA->PushString( change.old_value.c_str( ) );
+		LUA->PushString( value.c_str( ) );
+		if( LUA->PCall( 3, 0, 0 ) != 0 )
+		{
+			Warning( "[cvarsx] %s\n", LUA->GetString( -1 ) );
+			LUA->Pop( 1 );
+		}
+	}
+}
+
+static void Think( GarrysMod::Lua::ILuaBase *LUA, const std::unordered_map<ConVar *, changes::Change> &pending )
+{
+	for( const auto &entry : pending )
+		Notify( LUA, entry.first, entry.second );
+}
+
+static const binding::Function methods[] = {
+	{ "Watch", Watch },
+	{ "Unwatch", Unwatch }
+};
+
+static void Initialize( GarrysMod::Lua::ILuaBase *LUA )
+{
+	LUA->PushMetaTable( convar::metatype );
+	binding::Register( LUA, methods );
+	LUA->Pop( 1 );
+
+	global::unregister_callbacks.push_back( OnUnregister );
+}
+
+static void Deinitialize( GarrysMod::Lua::ILuaBase *LUA )
+{
+	ReleaseOrphans( LUA );
+
+	for( const auto &entry : watchers )
+		for( const Watcher &watcher : entry.second )
+			LUA->ReferenceFree( watcher.callback );
+
+	watchers.clear( );
+}
+
+}
+
+namespace cvars
+{
+
+static const char *table_name = "cvars";
+
+LUA_FUNCTION_STATIC( Exists )
+{
+	LUA->CheckType( 1, GarrysMod::Lua::Type::STRING );
+
+	ConVar *convar = global::icvar->FindVar( LUA->GetString( 1 ) );
+	if( convar == nullptr )
+		LUA->PushBool( false );
+	else
+		LUA->PushBool( !convar->IsCommand( ) );
+
+	return 1;
+}
+
+static int32_t getall_reference = -1;
+static uint64_t getall_generation = 0;
+
+// Fills the table on top of the stack in the shape GetAll always returned, mapping each handle
+// to its position in registration order. Previous contents are cleared first.
+static void Fill( GarrysMod::Lua::ILuaBase *LUA, const std::vector<ConVar *> &convars )
+{
+	LUA->PushNil( );
+	while( LUA->Next( -2 ) != 0 )
+	{
+		LUA->Pop( 1 );
+		LUA->Push( -1 );
+		LUA->PushNil( );
+		LUA->SetTable( -4 );
+	}
+
+	size_t i = 0;
+	for( ConVar *convar : convars )
+	{
+		convar::Push( LUA, convar );
+		LUA->PushNumber( ++i );
+		LUA->SetTable( -3 );
+	}
+}
+
+// Without arguments, returns a table shared between callers that is only rebuilt when
+// registrations change, so it must be treated as read-only. It's held strongly until then, which
+// keeps its handles alive; the previous table and its handles become collectable once replaced.
+// Pass a table to have it filled instead.
+LUA_FUNCTION_STATIC( GetAll )
+{
+	const std::vector<ConVar *> &convars = nameindex::GetConVars( );
+
+	if( LUA->IsType( 1, GarrysMod::Lua::Type::TABLE ) )
+	{
+		LUA->Push( 1 );
+		Fill( LUA, convars );
+		return 1;
+	}
+
+	if( getall_reference != -1 && getall_generation == global::generation )
+	{
+		LUA->ReferencePush( getall_reference );
+		return 1;
+	}
+
+	if( getall_reference != -1 )
+		LUA->ReferenceFree( getall_reference );
+
+	LUA->CreateTable( );
+	Fill( LUA, convars );
+
+	LUA->Push( -1 );
+	getall_reference = LUA->ReferenceCreate( );
+	getall_generation = global::generation;
+	return 1;
+}
+
+LUA_FUNCTION_STATIC( GetHandleCount )
+{
+	LUA->PushNumber( static_cast<double>( convar::alive ) );
+	return 1;
+}
+
+LUA_FUNCTION_STATIC( Get )
+{
+	convar::Push( LUA, global::icvar->FindVar( LUA->CheckString( 1 ) ) );
+	return 1;
+}
+
+enum class ValueKind
+{
+	Number,
+	Integer,
+	Bool,
+	String
+};
+
+// Optional "number" (default), "int", "bool" or "string" argument.
+static ValueKind CheckKind( GarrysMod::Lua::ILuaBase *LUA, int32_t index )
+{
+	if( LUA->IsType( index, GarrysMod::Lua::Type::NIL ) )
+		return ValueKind::Number;
+
+	const std::string name = LUA->CheckString( index );
+	if( name == "int" )
+		return ValueKind::Integer;
+	else if( name == "bool" )
+		return ValueKind::Bool;
+	else if( name == "string" )
+		return ValueKind::String;
+	else if( name != "number" )
+		LUA->ArgError( index, "kind should be \"number\", \"int\", \"bool\" or \"string\"" );
+
+	return ValueKind::Number;
+}
+
+static void PushValue( GarrysMod::Lua::ILuaBase *LUA, ConVar *convar, ValueKind kind )
+{
+	switch( kind )
+	{
+		case ValueKind::Number:
+			LUA->PushNumber( convar->GetFloat( ) );
+			break;
+
+		case ValueKind::Integer:
+			LUA->PushNumber( convar->GetInt( ) );
+			break;
+
+		case ValueKind::Bool:
+			LUA->PushBool( convar->GetBool( ) );
+			break;
+
+		case ValueKind::String:
+			LUA->PushString( convar->GetString( ) );
+			break;
+	}
+}
+
+// Returns an array with the value of each convar in names, which may hold names or handles, as
+// the given kind (see Mirror). Missing convars become false. Pass a table as the third argument
+// to have it filled instead of allocating a new one.
+LUA_FUNCTION_STATIC( GetValues )
+{
+	LUA->CheckType( 1, GarrysMod::Lua::Type::TABLE );
+	const ValueKind kind = CheckKind( LUA, 2 );
+
+	if( LUA->IsType( 3, GarrysMod::Lua::Type::TABLE ) )
+		LUA->Push( 3 );
+	else
+		LUA->CreateTable( );
+
+	const size_t count = static_cast<size_t>( LUA->ObjLen( 1 ) );
+	for( size_t i = 1; i <= count; ++i )
+	{
+		LUA->PushNumber( i );
+		LUA->PushNumber( i );
+		LUA->RawGet( 1 );
+
+		ConVar *convar = nullptr;
+		if( LUA->IsType( -1, GarrysMod::Lua::Type::STRING ) )
+			convar = global::icvar->FindVar( LUA->GetString( -1 ) );
+		else if( LUA->IsType( -1, convar::metatype ) )
+			convar = convar::GetUserdata( LUA, -1 )->cvar;
+
+		LUA->Pop( 1 );
+
+		if( convar != nullptr )
+			PushValue( LUA, convar, kind );
+		else
+			LUA->PushBool( false );
+
+		LUA->RawSet( -3 );
+	}
+
+	const size_t previous = static_cast<size_t>( LUA->ObjLen( -1 ) );
+	for( size_t i = count + 1; i <= previous; ++i )
+	{
+		LUA->PushNumber( i );
+		LUA->PushNil( );
+		LUA->RawSet( -3 );
+	}
+
+	return 1;
+}
+
+// Applies a { name = value } table, only writing the values that differ from the current ones.
+// Returns arrays with the changed, unchanged and unknown names, the latter also holding names
+// whose value is not a number, boolean or string.
+LUA_FUNCTION_STATIC( ApplyBatch )
+{
+	LUA->CheckType( 1, GarrysMod::Lua::Type::TABLE );
+
+	// The result tables are addressed as stack slots 2 to 4 below.
+	LUA->SetTop( 1 );
+
+	LUA->CreateTable( );
+	LUA->CreateTable( );
+	LUA->CreateTable( );
+	size_t counts[3] = { 0, 0, 0 };
+
+	LUA->PushNil( );
+	while( LUA->Next( 1 ) != 0 )
+	{
+		convar::Assignment result = convar::Assignment::Invalid;
+		if( LUA->IsType( -2, GarrysMod::Lua::Type::STRING ) )
+		{
+			ConVar *convar = global::icvar->FindVar( LUA->GetString( -2 ) );
+			if( convar != nullptr )
+				result = convar::Assign( LUA, convar, -1, true );
+		}
+
+		const int32_t list = static_cast<int32_t>( result );
+		LUA->PushNumber( static_cast<double>( ++counts[list] ) );
+		LUA->Push( -3 );
+		LUA->RawSet( 2 + list );
+
+		LUA->Pop( 1 );
+	}
+
+	return 3;
+}
+
+// Value a convar had before an override frame changed it. The name is only used to find the
+// convar again when registrations changed since the frame was pushed.
+struct PreviousValue
+{
+	ConVar *convar;
+	std::string name;
+	std::string value;
+};
+
+struct OverrideFrame
+{
+	uint64_t token;
+	uint64_t generation;
+	std::vector<PreviousValue> previous;
+};
+
+static std::vector<OverrideFrame> override_frames;
+static uint64_t next_override_token = 1;
+
+static size_t RestoreFrame( const OverrideFrame &frame )
+{
+	const bool stale = frame.generation != global::generation;
+
+	size_t restored = 0;
+	for( auto it = frame.previous.rbegin( ); it != frame.previous.rend( ); ++it )
+	{
+		ConVar *convar = stale ? global::icvar->FindVar( it->name.c_str( ) ) : it->convar;
+		if( convar == nullptr )
+			continue;
+
+		convar->SetValue( it->value.c_str( ) );
+		++restored;
+	}
+
+	return restored;
+}
+
+// Applies a { name = value } table like ApplyBatch, remembering the previous values of the
+// convars it actually changed. Returns a token for PopOverrides and the amount changed.
+LUA_FUNCTION_STATIC( PushOverrides )
+{
+	LUA->CheckType( 1, GarrysMod::Lua::Type::TABLE );
+
+	override_frames.emplace_back( );
+	OverrideFrame &frame = override_frames.back( );
+	frame.token = next_override_token++;
+	frame.generation = global::generation;
+
+	LUA->PushNil( );
+	while( LUA->Next( 1 ) != 0 )
+	{
+		ConVar *convar = nullptr;
+		if( LUA->IsType( -2, GarrysMod::Lua::Type::STRING ) )
+			convar = global::icvar->FindVar( LUA->GetString( -2 ) );
+
+		if( convar != nullptr )
+		{
+			const char *value = convar->m_pParent->m_pszString;
+			PreviousValue previous = { convar, convar->GetName( ), value != nullptr ? value : "" };
+			if( convar::Assign( LUA, convar, -1, true ) == convar::Assignment::Changed )
+				frame.previous.push_back( std::move( previous ) );
+		}
+
+		LUA->Pop( 1 );
+	}
+
+	LUA->PushNumber( static_cast<double>( frame.token ) );
+	LUA->PushNumber( static_cast<double>( frame.previous.size( ) ) );
+	return 2;
+}
+
+// Restores the values changed by the frame with the given token, newest change first. Frames
+// pushed after it are popped (and restored) first. Returns the amount of values restored, or
+// false if the token is unknown.
+LUA_FUNCTION_STATIC( PopOverrides )
+{
+	const uint64_t token = static_cast<uint64_t>( LUA->CheckNumber( 1 ) );
+
+	auto it = std::find_if( override_frames.begin( ), override_frames.end( ),
+		[token]( const OverrideFrame &frame )
+		{
+			return frame.token == token;
+		} );
+	if( it == override_frames.end( ) )
+	{
+		LUA->PushBool( false );
+		return 1;
+	}
+
+	const size_t position = static_cast<size_t>( it - override_frames.begin( ) );
+
+	size_t restored = 0;
+	while( override_frames.size( ) > position )
+	{
+		restored += RestoreFrame( override_frames.back( ) );
+		override_frames.pop_back( );
+	}
+
+	LUA->PushNumber( static_cast<double>( restored ) );
+	return 1;
+}
+
+LUA_FUNCTION_STATIC( Find )
+{
+	const char *pattern = LUA->CheckString( 1 );
+	size_t limit = 0;
+	if( !LUA->IsType( 2, GarrysMod::Lua::Type::NIL ) )
+		limit = static_cast<size_t>( LUA->CheckNumber( 2 ) );
+
+	LUA->CreateTable( );
+
+	size_t i = 0;
+	nameindex::Find( pattern, limit, [LUA, &i]( ConVar *convar )
+	{
+		LUA->PushNumber( ++i );
+		convar::Push( LUA, convar );
+		LUA->SetTable( -3 );
+	} );
+
+	return 1;
+}
+
+struct MirrorField
+{
+	int32_t table;
+	std::string field;
+	ValueKind kind;
+};
+
+static std::vector<int32_t> mirror_tables;
+static std::unordered_map<ConVar *, std::vector<MirrorField>> mirrors;
+
+// The mirror tables stay referenced, since other convars may still be mirrored into them.
+static void OnUnregister( ConVar *convar )
+{
+	mirrors.erase( convar );
+}
+
+// Sets the field of the mirror table on top of the stack to the convar's current value.
+static void WriteMirror( GarrysMod::Lua::ILuaBase *LUA, ConVar *convar, const MirrorField &mirror )
+{
+	PushValue( LUA, convar, mirror.kind );
+	LUA->SetField( -2, mirror.field.c_str( ) );
+}
+
+static void UpdateMirrors(
+	GarrysMod::Lua::ILuaBase *LUA,
+	const std::unordered_map<ConVar *, changes::Change> &pending
+)
+{
+	for( const auto &entry : pending )
+	{
+		auto it = mirrors.find( entry.first );
+		if( it == mirrors.end( ) )
+			continue;
+
+		for( const MirrorField &mirror : it->second )
+		{
+			LUA->ReferencePush( mirror.table );
+			WriteMirror( LUA, entry.first, mirror );
+			LUA->Pop( 1 );
+		}
+	}
+}
+
+// Keeps tbl[name] in sync with the value of each named convar, as a "number" (default), "int",
+// "bool" or "string". Fields are written once now and then only on the tick after a change.
+// Returns the amount of convars found.
+LUA_FUNCTION_STATIC( Mirror )
+{
+	LUA->CheckType( 1, GarrysMod::Lua::Type::TABLE );
+	LUA->CheckType( 2, GarrysMod::Lua::Type::TABLE );
+
+	const ValueKind kind = CheckKind( LUA, 3 );
+
+	LUA->Push( 1 );
+	const int32_t table = LUA->ReferenceCreate( );
+	mirror_tables.push_back( table );
+
+	size_t found = 0;
+	LUA->PushNil( );
+	while( LUA->Next( 2 ) != 0 )
+	{
+		ConVar *convar = nullptr;
+		if( LUA->IsType( -1, GarrysMod::Lua::Type::STRING ) )
+			convar = global::icvar->FindVar( LUA->GetString( -1 ) );
+
+		if( convar != nullptr )
+		{
+			const MirrorField mirror = { table, LUA->GetString( -1 ), kind };
+			mirrors[convar->m_pParent].push_back( mirror );
+			changes::Subscribe( convar );
+
+			LUA->Push( 1 );
+			WriteMirror( LUA, convar, mirror );
+			LUA->Pop( 1 );
+
+			++found;
+		}
+
+		LUA->Pop( 1 );
+	}
+
+	LUA->PushNumber( static_cast<double>( found ) );
+	return 1;
+}
+
+// Stops every mirror writing to tbl.
+LUA_FUNCTION_STATIC( Unmirror )
+{
+	LUA->CheckType( 1, GarrysMod::Lua::Type::TABLE );
+
+	for( auto table = mirror_tables.begin( ); table != mirror_tables.end( ); )
+	{
+		LUA->ReferencePush( *table );
+		const bool same = LUA->RawEqual( -1, 1 );
+		LUA->Pop( 1 );
+		if( !same )
+		{
+			++table;
+			continue;
+		}
+
+		for( auto it = mirrors.begin( ); it != mirrors.end( ); )
+		{
+			std::vector<MirrorField> &fields = it->second;
+			for( auto field = fields.begin( ); field != fields.end( ); )
+				if( field->table == *table )
+				{
+					changes::Unsubscribe( it->first );
+					field = fields.erase( field );
+				}
+				else
+				{
+					++field;
+				}
+
+			if( fields.empty( ) )
+				it = mirrors.erase( it );
+			else
+				++it;
+		}
+
+		LUA->ReferenceFree( *table );
+		table = mirror_tables.erase( table );
+	}
+
+	return 0;
+}
+
+static const binding::Function functions[] = {
+	{ "Exists", Exists },
+	{ "GetAll", GetAll },
+	{ "Get", Get },
+	{ "Find", Find },
+	{ "GetValues", GetValues },
+	{ "ApplyBatch", ApplyBatch },
+	{ "PushOverrides", PushOverrides },
+	{ "PopOverrides", PopOverrides },
+	{ "Mirror", Mirror },
+	{ "Unmirror", Unmirror },
+	{ "GetHandleCount", GetHandleCount }
+};
+
+static void Initialize( GarrysMod::Lua::ILuaBase *LUA )
+{
+	LUA->GetField( GarrysMod::Lua::INDEX_GLOBAL, table_name );
+	binding::Register( LUA, functions );
+	LUA->Pop( 1 );
+
+	global::unregister_callbacks.push_back( OnUnregister );
+}
+
+static void Deinitialize( GarrysMod::Lua::ILuaBase *LUA )
+{
+	LUA->GetField( GarrysMod::Lua::INDEX_GLOBAL, table_name );
+	binding::Unregister( LUA, functions );
+	LUA->Pop( 1 );
+
+	for( int32_t table : mirror_tables )
+		LUA->ReferenceFree( table );
+
+	mirror_tables.clear( );
+	mirrors.clear( );
+
+	if( getall_reference != -1 )
+	{
+		LUA->ReferenceFree( getall_reference );
+		getall_reference = -1;
+	}
+
+	override_frames.clear( );
+
+	nameindex::Deinitialize( );
+}
+
+}
+
+namespace snapshot
+{
+
+enum class Tag : uint8_t
+{
+	Integer,
+	String
+};
+
+// Names are interned, so entries of different snapshots can be matched by pointer. Values that
+// are canonical integers are stored inline, every other value lives in the snapshot's buffer.
+struct Entry
+{
+	const char *name;
+	ConVar *convar;
+	Tag tag;
+	int32_t integer;
+	uint32_t offset;
+};
+
+// Entries are sorted by name pointer.
+struct Snapshot
+{
+	uint64_t generation;
+	std::vector<Entry> entries;
+	std::string strings;
+};
+
+struct Container
+{
+	Snapshot *snapshot;
+};
+
+static const char metaname[] = "cvars_snapshot";
+static int32_t metatype = -1;
+
+// Interned name of each convar that was snapshotted, checked against its current name on use.
+static PointerMap<ConVar, const char *> names;
+
+static const char *InternName( ConVar *convar )
+{
+	const char *name = convar->GetName( );
+	const char **interned = names.Find( convar );
+	if( interned != nullptr && std::strcmp( *interned, name ) == 0 )
+		return *interned;
+
+	return names.Insert( convar, stringpool::Intern( name ) );
+}
+
+// Accepts what int formatting produces: no sign on zero, no leading zeros, no spaces.
+static bool ParseInteger( const char *str, int32_t &value )
+{
+	const char *digits = str[0] == '-' ? str + 1 : str;
+	const size_t length = std::strlen( digits );
+	if( length == 0 || length > 10 || ( digits[0] == '0' && ( length > 1 || digits != str ) ) )
+		return false;
+
+	int64_t result = 0;
+	for( size_t i = 0; i < length; ++i )
+	{
+		if( digits[i] < '0' || digits[i] > '9' )
+			return false;
+
+		result = result * 10 + ( digits[i] - '0' );
+	}
+
+	if( digits != str )
+		result = -result;
+
+	if( result < INT32_MIN || result > INT32_MAX )
+		return false;
+
+	value = static_cast<int32_t>( result );
+	return true;
+}
+
+inline const char *GetValue( const ConVar *convar )
+{
+	const char *value = convar->m_pParent->m_pszString;
+	return value != nullptr ? value : "";
+}
+
+static void AddEntry( Snapshot &snapshot, const char *name, ConVar *convar, const char *value )
+{
+	Entry entry = { name, convar, Tag::Integer, 0, 0 };
+	if( !ParseInteger( value, entry.integer ) )
+	{
+		entry.tag = Tag::String;
+		entry.offset = static_cast<uint32_t>( snapshot.strings.size( ) );
+		snapshot.strings.append( value );
+		snapshot.strings.push_back( '\0' );
+	}
+
+	snapshot.entries.push_back( entry );
+}
+
+static void Sort( Snapshot &snapshot )
+{
+	std::sort( snapshot.entries.begin( ), snapshot.entries.end( ), []( const Entry &a, const Entry &b )
+	{
+		return std::less<const char *>( )( a.name, b.name );
+	} );
+}
+
+inline const char *GetString( const Snapshot &snapshot, const Entry &entry )
+{
+	return snapshot.strings.c_str( ) + entry.offset;
+}
+
+static bool Matches( const Snapshot &snapshot, const Entry &entry, const char *value )
+{
+	if( entry.tag == Tag::String )
+		return std::strcmp( GetString( snapshot, entry ), value ) == 0;
+
+	int32_t integer = 0;
+	return ParseInteger( value, integer ) && integer == entry.integer;
+}
+
+static bool Equal( const Snapshot &a, const Entry &x, const Snapshot &b, const Entry &y )
+{
+	if( x.tag != y.tag )
+		return false;
+
+	if( x.tag == Tag::Integer )
+		return x.integer == y.integer;
+
+	return std::strcmp( GetString( a, x ), GetString( b, y ) ) == 0;
+}
+
+// Sets every convar of the snapshot whose current value differs, returning the amount set.
+// Convars that still don't hold the snapshot value afterwards, because of their bounds for
+// example, are counted in rejected.
+static size_t Apply( const Snapshot &snapshot, size_t *rejected = nullptr )
+{
+	const bool stale = snapshot.generation != global::generation;
+
+	size_t applied = 0;
+	for( const Entry &entry : snapshot.entries )
+	{
+		ConVar *convar = stale ? global::icvar->FindVar( entry.name ) : entry.convar;
+		if( convar == nullptr || Matches( snapshot, entry, GetValue( convar ) ) )
+			continue;
+
+		// SetValue( int ) ignores values equal to m_nValue, which "1.5" or "abc" may well have.
+		if( entry.tag == Tag::Integer )
+		{
+			char formatted[16];
+			std::snprintf( formatted, sizeof( formatted ), "%d", entry.integer );
+			convar->SetValue( formatted );
+		}
+		else
+		{
+			convar->SetValue( GetString( snapshot, entry ) );
+		}
+
+		if( rejected != nullptr && !Matches( snapshot, entry, GetValue( convar ) ) )
+			++*rejected;
+
+		++applied;
+	}
+
+	return applied;
+}
+
+static void PushEntryValue( GarrysMod::Lua::ILuaBase *LUA, const Snapshot &snapshot, const Entry &entry )
+{
+	if( entry.tag == Tag::Integer )
+		LUA->PushNumber( entry.integer );
+	else
+		LUA->PushString( GetString( snapshot, entry ) );
+}
+
+static void Push( GarrysMod::Lua::ILuaBase *LUA, Snapshot *snapshot )
+{
+	Container *udata = LUA->NewUserType<Container>( metatype );
+	udata->snapshot = snapshot;
+
+	LUA->PushMetaTable( metatype );
+	LUA->SetMetaTable( -2 );
+}
+
+static Snapshot *Get( GarrysMod::Lua::ILuaBase *LUA, int32_t index )
+{
+	if( !LUA->IsType( index, metatype ) )
+		LUA->TypeError( index, metaname );
+
+	return LUA->GetUserType<Container>( index, metatype )->snapshot;
+}
+
+// Takes a snapshot of the convars matching filter, which is either a pattern as in cvars.Find,
+// an array of names, or nil for every convar.
+static Snapshot *Take( GarrysMod::Lua::ILuaBase *LUA, int32_t filter )
+{
+	Snapshot *snapshot = new Snapshot;
+	snapshot->generation = global::generation;
+
+	auto add = [snapshot]( ConVar *convar )
+	{
+		AddEntry( *snapshot, InternName( convar ), convar, GetValue( convar ) );
+	};
+
+	switch( LUA->GetType( filter ) )
+	{
+		case GarrysMod::Lua::Type::NIL:
+		{
+			const std::vector<ConVar *> &convars = nameindex::GetConVars( );
+			snapshot->entries.reserve( convars.size( ) );
+			for( ConVar *convar : convars )
+				add( convar );
+
+			break;
+		}
+
+		case GarrysMod::Lua::Type::STRING:
+			nameindex::Find( LUA->GetString( filter ), 0, add );
+			break;
+
+		case GarrysMod::Lua::Type::TABLE:
+		{
+			const size_t count = static_cast<size_t>( LUA->ObjLen( filter ) );
+			for( size_t i = 1; i <= count; ++i )
+			{
+				LUA->PushNumber( i );
+				LUA->RawGet( filter );
+				if( LUA->IsType( -1, GarrysMod::Lua::Type::STRING ) )
+				{
+					ConVar *convar = global::icvar->FindVar( LUA->GetString( -1 ) );
+					if( convar != nullptr )
+						add( convar );
+				}
+
+				LUA->Pop( 1 );
+			}
+
+			break;
+		}
+
+		default:
+			delete snapshot;
+			LUA->ArgError( filter, "filter should be a string, a table or nil" );
+	}
+
+	Sort( *snapshot );
+	return snapshot;
+}
+
+LUA_FUNCTION_STATIC( gc )
+{
+	if( !LUA->IsType( 1, metatype ) )
+		return 0;
+
+	Container *udata = LUA->GetUserType<Container>( 1, metatype );
+	delete udata->snapshot;
+	udata->snapshot = nullptr;
+	return 0;
+}
+
+LUA_FUNCTION_STATIC( tostring )
+{
+	LUA->PushFormattedString( "%s: %p", metaname, Get( LUA, 1 ) );
+	return 1;
+}
+
+LUA_FUNCTION_STATIC( len )
+{
+	LUA->PushNumber( static_cast<double>( Get( LUA, 1 )->entries.size( ) ) );
+	return 1;
+}
+
+LUA_FUNCTION_STATIC( Create )
+{
+	Push( LUA, Take( LUA, 1 ) );
+	return 1;
+}
+
+// Sets the convars whose value differs from the snapshot and returns the amount set.
+LUA_FUNCTION_STATIC( Restore )
+{
+	LUA->PushNumber( static_cast<double>( Apply( *Get( LUA, 1 ) ) ) );
+	return 1;
+}
+
+// Returns a table with every name whose value differs between the snapshots, mapped to its
+// value in b, or false when b doesn't have it. Integers are returned as numbers.
+LUA_FUNCTION_STATIC( Diff )
+{
+	const Snapshot &a = *Get( LUA, 1 );
+	const Snapshot &b = *Get( LUA, 2 );
+
+	LUA->CreateTable( );
+
+	std::less<const char *> less;
+	auto x = a.entries.begin( ), y = b.entries.begin( );
+	while( x != a.entries.end( ) || y != b.entries.end( ) )
+	{
+		if( y == b.entries.end( ) || ( x != a.entries.end( ) && less( x->name, y->name ) ) )
+		{
+			LUA->PushBool( false );
+			LUA->SetField( -2, x->name );
+			++x;
+		}
+		else if( x == a.entries.end( ) || less( y->name, x->name ) )
+		{
+			PushEntryValue( LUA, b, *y );
+			LUA->SetField( -2, y->name );
+			++y;
+		}
+		else
+		{
+			if( !Equal( a, *x, b, *y ) )
+			{
+				PushEntryValue( LUA, b, *y );
+				LUA->SetField( -2, y->name );
+			}
+
+			++x;
+			++y;
+		}
+	}
+
+	return 1;
+}
+
+static const binding::Function metamethods[] = {
+	{ "__gc", gc },
+	{ "__tostring", tostring },
+	{ "__len", len }
+};
+
+static const binding::Function functions[] = {
+	{ "Snapshot", Create },
+	{ "Restore", Restore },
+	{ "Diff", Diff }
+};
+
+static void Initialize( GarrysMod::Lua::ILuaBase *LUA )
+{
+	metatype = LUA->CreateMetaTable( metaname );
+	binding::Register( LUA, metamethods );
+	LUA->Pop( 1 );
+
+	LUA->GetField( GarrysMod::Lua::INDEX_GLOBAL, cvars::table_name );
+	binding::Register( LUA, functions );
+	LUA->Pop( 1 );
+}
+
+static void Deinitialize( GarrysMod::Lua::ILuaBase *LUA )
+{
+	LUA->GetField( GarrysMod::Lua::INDEX_GLOBAL, cvars::table_name );
+	binding::Unregister( LUA, functions );
+	LUA->Pop( 1 );
+
+	LUA->PushNil( );
+	LUA->SetField( GarrysMod::Lua::INDEX_REGISTRY, metaname );
+
+	names.Clear( );
+}
+
+}
+
+namespace state
+{
+
+// Little endian layout: magic, version, entry count and the CRC32 of the version, the count and
+// everything after the header. Each entry is a 16 bits name length, the name, a snapshot::Tag byte and either a
+// 32 bits integer or a 16 bits string length followed by the string.
+static const uint8_t magic[4] = { 'C', 'V', 'X', 'S' };
+static const uint32_t version = 2;
+static const size_t header_size = 16;
+static const size_t max_length = 0xFFFF;
+static const size_t max_file_size = 0x7FFFFFFF;
+
+// An empty name followed by the tag and an empty string.
+static const size_t min_entry_size = 5;
+
+// State files are always relative to this directory.
+static const char data_directory[] = "garrysmod/data/";
+
+static const char parameter[] = "-cvarsx_state";
+
+inline void WriteU16( std::vector<uint8_t> &buffer, uint32_t value )
+{
+	buffer.push_back( static_cast<uint8_t>( value ) );
+	buffer.push_back( static_cast<uint8_t>( value >> 8 ) );
+}
+
+inline void WriteU32( std::vector<uint8_t> &buffer, uint32_t value )
+{
+	WriteU16( buffer, value & 0xFFFF );
+	WriteU16( buffer, value >> 16 );
+}
+
+inline void PatchU32( std::vector<uint8_t> &buffer, size_t offset, uint32_t value )
+{
+	for( size_t i = 0; i < 4; ++i )
+		buffer[offset + i] = static_cast<uint8_t>( value >> ( i * 8 ) );
+}
+
+inline uint32_t ReadU16( const uint8_t *data )
+{
+	return static_cast<uint32_t>( data[0] ) | static_cast<uint32_t>( data[1] ) << 8;
+}
+
+inline uint32_t ReadU32( const uint8_t *data )
+{
+	return ReadU16( data ) | ReadU16( data + 2 ) << 16;
+}
+
+static CRC32_t Checksum( const uint8_t *data, size_t size )
+{
+	CRC32_t crc;
+	CRC32_Init( &crc );
+	CRC32_ProcessBuffer( &crc, data + 4, 8 );
+	CRC32_ProcessBuffer( &crc, data + header_size, static_cast<int>( size - header_size ) );
+	CRC32_Final( &crc );
+	return crc;
+}
+
+// Entries with names or values too long for the format are left out.
+static void Serialize( const snapshot::Snapshot &snapshot, std::vector<uint8_t> &buffer )
+{
+	buffer.assign( magic, magic + sizeof( magic ) );
+	WriteU32( buffer, version );
+	WriteU32( buffer, 0 );
+	WriteU32( buffer, 0 );
+
+	uint32_t count = 0;
+	for( const snapshot::Entry &entry : snapshot.entries )
+	{
+		const size_t name_length = std::strlen( entry.name );
+		const char *value = snapshot::GetString( snapshot, entry );
+		const size_t value_length = entry.tag == snapshot::Tag::String ? std::strlen( value ) : 0;
+		if( name_length > max_length || value_length > max_length )
+			continue;
+
+		WriteU16( buffer, static_cast<uint32_t>( name_length ) );
+		buffer.insert( buffer.end( ), entry.name, entry.name + name_length );
+		buffer.push_back( static_cast<uint8_t>( entry.tag ) );
+		if( entry.tag == snapshot::Tag::Integer )
+		{
+			WriteU32( buffer, static_cast<uint32_t>( entry.integer ) );
+		}
+		else
+		{
+			WriteU16( buffer, static_cast<uint32_t>( value_length ) );
+			buffer.insert( buffer.end( ), value, value + value_length );
+		}
+
+		++count;
+	}
+
+	PatchU32( buffer, 8, count );
+	PatchU32( buffer, 12, Checksum( buffer.data( ), buffer.size( ) ) );
+}
+
+// Fills the snapshot with the file's entries, resolving each name with FindVar. Returns an
+// error message when the data is not a valid state file.
+static const char *Deserialize( const uint8_t *data, size_t size, snapshot::Snapshot &snapshot )
+{
+	if( size < header_size || std::memcmp( data, magic, sizeof( magic ) ) != 0 )
+		return "not a state file";
+
+	if( size > max_file_size )
+		return "state file is too large";
+
+	if( ReadU32( data + 4 ) != version )
+		return "unsupported state file version";
+
+	if( ReadU32( data + 12 ) != Checksum( data, size ) )
+		return "checksum mismatch";
+
+	const uint32_t count = ReadU32( data + 8 );
+	if( count > ( size - header_size ) / min_entry_size )
+		return "entry count exceeds file size";
+
+	const uint8_t *cursor = data + header_size, *end = data + size;
+	snapshot.generation = global::generation;
+	snapshot.entries.reserve( count );
+
+	std::string name, value;
+	for( uint32_t i = 0; i < count; ++i )
+	{
+		if( end - cursor < 2 )
+			return "truncated entry";
+
+		const size_t name_length = ReadU16( cursor );
+		cursor += 2;
+		if( static_cast<size_t>( end - cursor ) < name_length + 1 )
+			return "truncated entry";
+
+		name.assign( reinterpret_cast<const char *>( cursor ), name_length );
+		cursor += name_length;
+
+		const uint8_t tag = *cursor++;
+		snapshot::Entry entry = { nullptr, nullptr, snapshot::Tag::Integer, 0, 0 };
+		if( tag == static_cast<uint8_t>( snapshot::Tag::Integer ) )
+		{
+			if( end - cursor < 4 )
+				return "truncated entry";
+
+			entry.integer = static_cast<int32_t>( ReadU32( cursor ) );
+			cursor += 4;
+		}
+		else if( tag == static_cast<uint8_t>( snapshot::Tag::String ) )
+		{
+			if( end - cursor < 2 )
+				return "truncated entry";
+
+			const size_t value_length = ReadU16( cursor );
+			cursor += 2;
+			if( static_cast<size_t>( end - cursor ) < value_length )
+				return "truncated entry";
+
+			value.assign( reinterpret_cast<const char *>( cursor ), value_length );
+			cursor += value_length;
+
+			entry.tag = snapshot::Tag::String;
+			entry.offset = static_cast<uint32_t>( snapshot.strings.size( ) );
+			snapshot.strings.append( value.c_str( ) );
+			snapshot.strings.push_back( '\0' );
+		}
+		else
+		{
+			return "invalid entry tag";
+		}
+
+		entry.name = stringpool::Intern( name.c_str( ) );
+		entry.convar = global::icvar->FindVar( entry.name );
+		snapshot.entries.push_back( entry );
+	}
+
+	if( cursor != end )
+		return "trailing data after entries";
+
+	snapshot::Sort( snapshot );
+	return nullptr;
+}
+
+// Read-only view of a whole file.
+class MappedFile
+{
+public:
+	explicit MappedFile( const std::string &path )
+	{
+#if defined _WIN32
+
+		file = CreateFileA( path.c_str( ), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+			FILE_ATTRIBUTE_NORMAL, nullptr );
+		if( file == INVALID_HANDLE_VALUE )
+			return;
+
+		LARGE_INTEGER file_size;
+		if( !GetFileSizeEx( file, &file_size ) || file_size.QuadPart == 0 )
+			return;
+
+		mapping = CreateFileMappingA( file, nullptr, PAGE_READONLY, 0, 0, nullptr );
+		if( mapping == nullptr )
+			return;
+
+		view = MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 );
+		if( view != nullptr )
+			size = static_cast<size_t>( file_size.QuadPart );
+
+#else
+
+		fd = open( path.c_str( ), O_RDONLY );
+		if( fd == -1 )
+			return;
+
+		struct stat info;
+		if( fstat( fd, &info ) != 0 || info.st_size == 0 )
+			return;
+
+		void *address = mmap( nullptr, static_cast<size_t>( info.st_size ), PROT_READ, MAP_PRIVATE, fd, 0 );
+		if( address == MAP_FAILED )
+			return;
+
+		view = address;
+		size = static_cast<size_t>( info.st_size );
+
+#endif
+	}
+
+	~MappedFile( )
+	{
+#if defined _WIN32
+
+		if( view != nullptr )
+			UnmapViewOfFile( view );
+
+		if( mapping != nullptr )
+			CloseHandle( mapping );
+
+		if( file != INVALID_HANDLE_VALUE )
+			CloseHandle( file );
+
+#else
+
+		if( view != nullptr )
+			munmap( view, size );
+
+		if( fd != -1 )
+			close( fd );
+
+#endif
+	}
+
+	MappedFile( const MappedFile & ) = delete;
+	MappedFile &operator=( const MappedFile & ) = delete;
+
+	bool IsValid( ) const
+	{
+		return view != nullptr;
+	}
+
+	const uint8_t *Data( ) const
+	{
+		return static_cast<const uint8_t *>( view );
+	}
+
+	size_t Size( ) const
+	{
+		return size;
+	}
+
+private:
+#if defined _WIN32
+
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = nullptr;
+
+#else
+
+	int fd = -1;
+
+#endif
+
+	void *view = nullptr;
+	size_t size = 0;
+};
+
+// Paths are relative to the data directory and may only use [A-Za-z0-9_-./], without "..".
+static bool ResolvePath( const char *path, std::string &resolved )
+{
+	if( path[0] == '\0' || path[0] == '/' || std::strstr( path, ".." ) != nullptr )
+		return false;
+
+	for( const char *c = path; *c != '\0'; ++c )
+		if( !std::isalnum( static_cast<unsigned char>( *c ) ) &&
+			*c != '_' && *c != '-' && *c != '.' && *c != '/' )
+			return false;
+
+	resolved = data_directory;
+	resolved += path;
+	return true;
+}
+
+// Returns an error message on failure, otherwise the amount of convars set.
+static const char *Load( const char *path, size_t &applied, size_t &rejected )
+{
+	std::string resolved;
+	if( !ResolvePath( path, resolved ) )
+		return "invalid path";
+
+	snapshot::Snapshot snapshot;
+	{
+		MappedFile file( resolved );
+		if( !file.IsValid( ) )
+			return "unable to map file";
+
+		const char *error = Deserialize( file.Data( ), file.Size( ), snapshot );
+		if( error != nullptr )
+			return error;
+	}
+
+	rejected = 0;
+	applied = snapshot::Apply( snapshot, &rejected );
+	return nullptr;
+}
+
+static const char *Save( const char *path, const snapshot::Snapshot &snapshot )
+{
+	std::string resolved;
+	if( !ResolvePath( path, resolved ) )
+		return "invalid path";
+
+	std::vector<uint8_t> buffer;
+	Serialize( snapshot, buffer );
+
+	FILE *file = std::fopen( resolved.c_str( ), "wb" );
+	if( file == nullptr )
+		return "unable to open file";
+
+	const bool written = std::fwrite( buffer.data( ), 1, buffer.size( ), file ) == buffer.size( );
+	if( std::fclose( file ) != 0 || !written )
+		return "unable to write file";
+
+	return nullptr;
+}
+
+// Applies the state file at path (relative to the data directory). Returns the amount of
+// convars set and how many of those didn't end up with the file's value, or nil and an error
+// message.
+LUA_FUNCTION_STATIC( LoadState )
+{
+	size_t applied = 0, rejected = 0;
+	const char *error = Load( LUA->CheckString( 1 ), applied, rejected );
+	if( error != nullptr )
+	{
+		LUA->PushNil( );
+		LUA->PushString( error );
+		return 2;
+	}
+
+	LUA->PushNumber( static_cast<double>( applied ) );
+	LUA->PushNumber( static_cast<double>( rejected ) );
+	return 2;
+}
+
+// Writes the convars matching filter (see cvars.Snapshot) to a state file at path. Returns true,
+// or nil and an error message.
+LUA_FUNCTION_STATIC( SaveState )
+{
+	const char *path = LUA->CheckString( 1 );
+	std::unique_ptr<snapshot::Snapshot> snapshot( snapshot::Take( LUA, 2 ) );
+
+	const char *error = Save( path, *snapshot );
+	if( error != nullptr )
+	{
+		LUA->PushNil( );
+		LUA->PushString( error );
+		return 2;
+	}
+
+	LUA->PushBool( true );
+	return 1;
+}
+
+static const binding::Function functions[] = {
+	{ "LoadState", LoadState },
+	{ "SaveState", SaveState }
+};
+
+static void Initialize( GarrysMod::Lua::ILuaBase *LUA )
+{
+	LUA->GetField( GarrysMod::Lua::INDEX_GLOBAL, cvars::table_name );
+	binding::Register( LUA, functions );
+	LUA->Pop( 1 );
+
+	const char *path = CommandLine( )->ParmValue( parameter );
+	if( path == nullptr )
+		return;
+
+	size_t applied = 0, rejected = 0;
+	const char *error = Load( path, applied, rejected );
+	if( error != nullptr )
+		Warning( "[cvarsx] failed to load state file '%s': %s\n", path, error );
+	else if( rejected != 0 )
+		Warning( "[cvarsx] applied %u convars from state file '%s', %u of them rejected the value\n",
+			static_cast<uint32_t>( applied ), path, static_cast<uint32_t>( rejected ) );
+	else
+		Msg( "[cvarsx] applied %u convars from state file '%s'\n", static_cast<uint32_t>( applied ), path );
+}
+
+static void Deinitialize( GarrysMod::Lua::ILuaBase *LUA )
+{
+	LUA->GetField( GarrysMod::Lua::INDEX_GLOBAL, cvars::table_name );
+	binding::Unregister( LUA, functions );
+	LUA->Pop( 1 );
+}
+
+}
+
+#if defined CVARSX_SERVER
+
+namespace Player
+{
+
+static const char *invalid_error = "invalid Player";
+
+// Entity userdata holds the entity's handle, which already encodes its index.
+// Returns 0 for NULL entities, like Entity:EntIndex.
+inline int32_t GetEntityIndex( GarrysMod::Lua::ILuaBase *LUA, int32_t i )
+{
+	const CBaseHandle *handle = LUA->GetUserType<CBaseHandle>( i, GarrysMod::Lua::Type::ENTITY );
+	if( handle == nullptr || !handle->IsValid( ) )
+		return 0;
+
+	// The slot may have been reused since this handle was made, so the serial number has to match
+	// the one of the entity currently living there.
+	const int32_t entindex = handle->GetEntryIndex( );
+	edict_t *edict = global::ivengine->PEntityOfEntIndex( entindex );
+	if( edict == nullptr || edict->IsFree( ) )
+		return 0;
+
+	IServerUnknown *unknown = edict->GetUnknown( );
+	if( unknown == nullptr || unknown->GetRefEHandle( ) != *handle )
+		return 0;
+
+	return entindex;
+}
+
+static const int32_t net_SetConVar = 5;
+static const int32_t net_message_bits = 6;
+
+// Clients read names and values into MAX_OSPATH sized buffers and the pair count is a byte.
+static const size_t max_string_length = 259;
+static const size_t max_pairs_per_message = 255;
+static const size_t max_message_size = 4096;
+
+struct Pair
+{
+	const char *name;
+	const char *value;
+};
+
+// An encoded net message that can be sent to any number of net channels.
+struct Message
+{
+	std::vector<uint8_t> buffer;
+	int32_t bits = 0;
+	size_t pairs = 0;
+};
+
+inline size_t PairSize( const Pair &pair )
+{
+	return std::strlen( pair.name ) + 1 + std::strlen( pair.value ) + 1;
+}
+
+inline bool IsValidPair( const Pair &pair )
+{
+	return std::strlen( pair.name ) <= max_string_length &&
+		std::strlen( pair.value ) <= max_string_length;
+}
+
+static bool EncodeSetConVar( Message &message, const Pair *pairs, size_t count )
+{
+	size_t size = 2;
+	for( size_t k = 0; k < count; ++k )
+		size += PairSize( pairs[k] );
+
+	// bf_write works on whole dwords and truncates its size to a multiple of 4.
+	message.buffer.assign( ( size + 3 ) & ~static_cast<size_t>( 3 ), 0 );
+	bf_write packet( message.buffer.data( ), static_cast<int32_t>( message.buffer.size( ) ) );
+	packet.SetAssertOnOverflow( false );
+
+	packet.WriteUBitLong( net_SetConVar, net_message_bits );
+	packet.WriteByte( static_cast<int32_t>( count ) );
+	for( size_t k = 0; k < count; ++k )
+	{
+		packet.WriteString( pairs[k].name );
+		packet.WriteString( pairs[k].value );
+	}
+
+	message.bits = packet.GetNumBitsWritten( );
+	return !packet.IsOverflowed( );
+}
+
+inline bool EncodeSetConVar( Message &message, const char *name, const char *value )
+{
+	const Pair pair = { name, value };
+	return IsValidPair( pair ) && EncodeSetConVar( message, &pair, 1 );
+}
+
+// Packs the pairs greedily into as few messages as the count byte and max_message_size allow.
+// Pairs must have been checked with IsValidPair.
+static bool EncodeSetConVars( std::vector<Message> &messages, const std::vector<Pair> &pairs )
+{
+	size_t first = 0;
+	while( first < pairs.size( ) )
+	{
+		size_t last = first, size = 2;
+		while( last < pairs.size( ) && last - first < max_pairs_per_message )
+		{
+			const size_t pair_size = PairSize( pairs[last] );
+			if( last != first && size + pair_size > max_message_size )
+				break;
+
+			size += pair_size;
+			++last;
+		}
+
+		messages.emplace_back( );
+		if( !EncodeSetConVar( messages.back( ), &pairs[first], last - first ) )
+		{
+			messages.pop_back( );
+			return false;
+		}
+
+		messages.back( ).pairs = last - first;
+		first = last;
+	}
+
+	return true;
+}
+
+static bool Send( INetChannel *netchan, Message &message )
+{
+	bf_write packet( message.buffer.data( ), static_cast<int32_t>( message.buffer.size( ) ) );
+	packet.SeekToBit( message.bits );
+	return netchan->SendData( packet );
+}
+
+struct UserInfo
+{
+	std::string value;
+	int32_t changed = 0;
+};
+
+struct Client
+{
+	// Channel the state below belongs to, everything is dropped when it changes.
+	INetChannel *netchan = nullptr;
+
+	// Deferred net_SetConVar writes keyed by name, so only the last value queued in a tick is sent.
+	std::unordered_map<std::string, std::string> pending;
+
+	// Last value sent through this module for each name.
+	std::unordered_map<std::string, std::string> sent;
+
+	// Cached values of tracked userinfo cvars.
+	std::unordered_map<std::string, UserInfo> userinfo;
+};
+
+static std::vector<Client> clients;
+static std::unordered_set<std::string> tracked;
+static size_t queue_budget = 16384;
+static int32_t flush_start = 1;
+
+// Returns the state of a connected client, resetting it when the client left or reconnected.
+static Client *GetClient( int32_t entindex )
+{
+	if( entindex < 1 || static_cast<size_t>( entindex ) >= clients.size( ) )
+		return nullptr;
+
+	Client &client = clients[entindex];
+	INetChannel *netchan = static_cast<INetChannel *>(
+		global::ivengine->GetPlayerNetInfo( entindex )
+	);
+	if( netchan != client.netchan )
+	{
+		client = Client( );
+		client.netchan = netchan;
+	}
+
+	return netchan != nullptr ? &client : nullptr;
+}
+
+inline bool WasSent( const Client &client, const Pair &pair )
+{
+	auto it = client.sent.find( pair.name );
+	return it != client.sent.end( ) && it->second == pair.value;
+}
+
+// Reads a userinfo cvar of a client, from the cache when the cvar is tracked.
+static const char *GetUserInfo( int32_t entindex, const char *name )
+{
+	if( !tracked.empty( ) )
+	{
+		Client *client = GetClient( entindex );
+		if( client != nullptr )
+		{
+			auto it = client->userinfo.find( name );
+			if( it != client->userinfo.end( ) )
+				return it->second.value.c_str( );
+
+			if( tracked.find( name ) != tracked.end( ) )
+			{
+				UserInfo &info = client->userinfo[name];
+				info.value = global::ivengine->GetClientConVarValue( entindex, name );
+				info.changed = global::globals->tickcount;
+				return info.value.c_str( );
+			}
+		}
+	}
+
+	return global::ivengine->GetClientConVarValue( entindex, name );
+}
+
+// Rereads every tracked cvar of a client, stamping the ones that changed with the current tick.
+static void RefreshUserInfo( int32_t entindex )
+{
+	Client *client = GetClient( entindex );
+	if( client == nullptr )
+		return;
+
+	for( const std::string &name : tracked )
+	{
+		const char *value = global::ivengine->GetClientConVarValue( entindex, name.c_str( ) );
+		auto result = client->userinfo.emplace( name, UserInfo( ) );
+		UserInfo &info = result.first->second;
+		if( result.second || info.value != value )
+		{
+			info.value = value;
+			info.changed = global::globals->tickcount;
+		}
+	}
+}
+
+// The engine calls ClientSettingsChanged whenever a client's userinfo cvars are updated.
+class ServerGameClientsProxy : public Detouring::ClassProxy<IServerGameClients, ServerGameClientsProxy>
+{
+public:
+	ServerGameClientsProxy( IServerGameClients *gameclients )
+	{
+		Initialize( gameclients );
+		Hook( &IServerGameClients::ClientSettingsChanged, &ServerGameClientsProxy::ClientSettingsChanged );
+	}
+
+	~ServerGameClientsProxy( )
+	{
+		UnHook( &IServerGameClients::ClientSettingsChanged );
+	}
+
+	virtual void ClientSettingsChanged( edict_t *edict )
+	{
+		Call( &IServerGameClients::ClientSettingsChanged, edict );
+
+		if( !tracked.empty( ) )
+			RefreshUserInfo( global::ivengine->IndexOfEdict( edict ) );
+	}
+};
+
+static ServerGameClientsProxy *gameclients_proxy = nullptr;
+
+// Sends the pairs that would change something on the client (all of them when forced) and
+// records them as sent. Returns false if any message failed to encode or send.
+static bool SendPairs( Client &client, const std::vector<Pair> &pairs, bool force, size_t *sent_messages = nullptr )
+{
+	std::vector<Pair> changed;
+	changed.reserve( pairs.size( ) );
+	for( const Pair &pair : pairs )
+		if( force || !WasSent( client, pair ) )
+			changed.push_back( pair );
+
+	std::vector<Message> messages;
+	bool success = EncodeSetConVars( messages, changed );
+
+	// Only the pairs of messages that actually went out are remembered as sent.
+	size_t first = 0;
+	for( Message &message : messages )
+	{
+		if( Send( client.netchan, message ) )
+			for( size_t i = first; i < first + message.pairs; ++i )
+				client.sent[changed[i].name] = changed[i].value;
+		else
+			success = false;
+
+		first += message.pairs;
+	}
+
+	if( sent_messages != nullptr )
+		*sent_messages = messages.size( );
+
+	return success;
+}
+
+// Sends as much of the client's queue as fits in budget, returning the amount of bytes used.
+// An empty budget still sends a single pair, so oversized queues always make progress. Sets
+// failed when some pairs couldn't be encoded or sent.
+static size_t Flush( Client &client, size_t budget, bool force, bool &failed )
+{
+	size_t used = 0;
+	std::vector<Pair> pairs;
+	std::vector<std::string> flushed;
+	for( const auto &entry : client.pending )
+	{
+		const Pair pair = { entry.first.c_str( ), entry.second.c_str( ) };
+		if( !WasSent( client, pair ) )
+		{
+			const size_t size = PairSize( pair );
+			if( used + size > budget && !( force && pairs.empty( ) ) )
+				break;
+
+			pairs.push_back( pair );
+			used += size;
+		}
+
+		flushed.push_back( entry.first );
+	}
+
+	failed = !SendPairs( client, pairs, false );
+
+	// Pairs that failed to encode or send stay queued for the next tick.
+	for( const std::string &name : flushed )
+	{
+		auto it = client.pending.find( name );
+		if( WasSent( client, { it->first.c_str( ), it->second.c_str( ) } ) )
+			client.pending.erase( it );
+	}
+
+	return used;
+}
+
+// Called every tick, spreading queued writes over as many ticks as queue_budget requires.
+// The starting client rotates so a large queue can't starve the ones after it.
+static void FlushQueues( )
+{
+	const int32_t count = static_cast<int32_t>( clients.size( ) ) - 1;
+	if( count <= 0 )
+		return;
+
+	for( int32_t entindex = 1; entindex <= count; ++entindex )
+		if( clients[entindex].netchan != nullptr )
+			GetClient( entindex );
+
+	size_t budget = queue_budget;
+	bool force = true;
+	for( int32_t k = 0; k < count; ++k )
+	{
+		const int32_t entindex = ( flush_start - 1 + k ) % count + 1;
+		Client &client = clients[entindex];
+		if( client.pending.empty( ) )
+			continue;
+
+		bool failed = false;
+		const size_t used = Flush( client, budget, force, failed );
+		budget = used < budget ? budget - used : 0;
+		force = false;
+
+		// A client whose pairs keep failing is retried next tick, but must not hold back the
+		// clients after it.
+		if( failed )
+			continue;
+
+		if( !client.pending.empty( ) )
+		{
+			flush_start = entindex;
+			return;
+		}
+	}
+
+	flush_start = flush_start % count + 1;
+}
+
+struct QueryAnswer
+{
+	int32_t entindex;
+	std::string name;
+	QueryCvarCookie_t cookie = InvalidQueryCvarCookie;
+	bool answered = false;
+	EQueryCvarValueStatus status = eQueryCvarValueStatus_CvarNotFound;
+	std::string value;
+};
+
+// A batch of cvar queries, possibly spanning several players, answered through one callback.
+struct Query
+{
+	int32_t callback = -1;
+	bool enforcement = false;
+	bool single_player = true;
+	float deadline = 0.0f;
+	size_t remaining = 0;
+	std::vector<QueryAnswer> answers;
+};
+
+struct QueryCookie
+{
+	uint64_t query;
+	size_t answer;
+};
+
+static std::unordered_map<uint64_t, Query> queries;
+static std::unordered_map<QueryCvarCookie_t, QueryCookie> cookies;
+static uint64_t next_query = 0;
+
+static void AddQuery( Query &query, int32_t entindex, const char *name )
+{
+	query.answers.emplace_back( );
+	QueryAnswer &answer = query.answers.back( );
+	answer.entindex = entindex;
+	answer.name = name;
+}
+
+// Sends every query of the batch, answers that couldn't be requested are left as not found.
+static void StartQuery( Query &&query )
+{
+	const uint64_t id = next_query++;
+	Query &started = queries.emplace( id, std::move( query ) ).first->second;
+
+	for( size_t k = 0; k < started.answers.size( ); ++k )
+	{
+		QueryAnswer &answer = started.answers[k];
+		edict_t *edict = global::ivengine->PEntityOfEntIndex( answer.entindex );
+		if( edict == nullptr || global::ivengine->GetPlayerNetInfo( answer.entindex ) == nullptr )
+			continue;
+
+		answer.cookie = global::ivengine->StartQueryCvarValue( edict, answer.name.c_str( ) );
+		if( answer.cookie == InvalidQueryCvarCookie )
+			continue;
+
+		cookies[answer.cookie] = { id, k };
+		++started.remaining;
+	}
+}
+
+static void OnQueryCvarValueFinished(
+	QueryCvarCookie_t cookie,
+	EQueryCvarValueStatus status,
+	const char *value
+)
+{
+	auto it = cookies.find( cookie );
+	if( it == cookies.end( ) )
+		return;
+
+	Query &query = queries[it->second.query];
+	QueryAnswer &answer = query.answers[it->second.answer];
+	answer.answered = true;
+	answer.status = status;
+	answer.value = value != nullptr ? value : "";
+	--query.remaining;
+
+	cookies.erase( it );
+}
+
+// Client answers to StartQueryCvarValue are delivered to the game DLL through this virtual.
+class ServerGameDLLProxy : public Detouring::ClassProxy<IServerGameDLL, ServerGameDLLProxy>
+{
+public:
+	ServerGameDLLProxy( IServerGameDLL *gamedll )
+	{
+		Initialize( gamedll );
+		Hook( &IServerGameDLL::OnQueryCvarValueFinished, &ServerGameDLLProxy::OnQueryCvarValueFinished );
+	}
+
+	~ServerGameDLLProxy( )
+	{
+		UnHook( &IServerGameDLL::OnQueryCvarValueFinished );
+	}
+
+	virtual void OnQueryCvarValueFinished(
+		QueryCvarCookie_t cookie,
+		edict_t *edict,
+		EQueryCvarValueStatus status,
+		const char *name,
+		const char *value
+	)
+	{
+		Call( &IServerGameDLL::OnQueryCvarValueFinished, cookie, edict, status, name, value );
+		Player::OnQueryCvarValueFinished( cookie, status, value );
+	}
+};
+
+static ServerGameDLLProxy *gamedll_proxy = nullptr;
+
+struct Violation
+{
+	int32_t entindex;
+	std::string name;
+	std::string value;
+};
+
+static std::vector<Violation> CheckEnforcement( const Query &query );
+static void ReportViolations( GarrysMod::Lua::ILuaBase *LUA, const std::vector<Violation> &violations );
+
+inline void PushAnswer( GarrysMod::Lua::ILuaBase *LUA, const QueryAnswer &answer )
+{
+	if( answer.answered && answer.status == eQueryCvarValueStatus_ValueIntact )
+		LUA->PushString( answer.value.c_str( ) );
+	else
+		LUA->PushBool( false );
+}
+
+// Hands finished or timed out batches to their callbacks. Values that weren't answered,
+// don't exist or are protected are reported as false.
+static void DeliverQueries( GarrysMod::Lua::ILuaBase *LUA )
+{
+	std::vector<uint64_t> finished;
+	for( const auto &entry : queries )
+		if( entry.second.remaining == 0 || entry.second.deadline <= global::globals->realtime )
+			finished.push_back( entry.first );
+
+	for( uint64_t id : finished )
+	{
+		Query query = std::move( queries[id] );
+		queries.erase( id );
+
+		for( const QueryAnswer &answer : query.answers )
+			if( !answer.answered && answer.cookie != InvalidQueryCvarCookie )
+				cookies.erase( answer.cookie );
+
+		if( query.enforcement )
+		{
+			ReportViolations( LUA, CheckEnforcement( query ) );
+			continue;
+		}
+
+		LUA->ReferencePush( query.callback );
+		LUA->ReferenceFree( query.callback );
+
+		LUA->CreateTable( );
+		for( const QueryAnswer &answer : query.answers )
+		{
+			if( query.single_player )
+			{
+				PushAnswer( LUA, answer );
+				LUA->SetField( -2, answer.name.c_str( ) );
+				continue;
+			}
+
+			LUA->PushNumber( answer.entindex );
+			LUA->GetTable( -2 );
+			if( !LUA->IsType( -1, GarrysMod::Lua::Type::TABLE ) )
+			{
+				LUA->Pop( 1 );
+				LUA->CreateTable( );
+				LUA->PushNumber( answer.entindex );
+				LUA->Push( -2 );
+				LUA->SetTable( -4 );
+			}
+
+			PushAnswer( LUA, answer );
+			LUA->SetField( -2, answer.name.c_str( ) );
+			LUA->Pop( 1 );
+		}
+
+		if( LUA->PCall( 1, 0, 0 ) != 0 )
+		{
+			Warning( "[cvarsx] %s\n", LUA->GetString( -1 ) );
+			LUA->Pop( 1 );
+		}
+	}
+}
+
+// State of a policy for one player, so a pair is never queried again while a query for it is
+// in flight or before the recheck interval elapsed.
+struct PolicyCheck
+{
+	bool in_flight = false;
+	float next = 0.0f;
+};
+
+struct Policy
+{
+	std::string name;
+	std::vector<std::string> allowed;
+	bool has_min = false;
+	float min = 0.0f;
+	bool has_max = false;
+	float max = 0.0f;
+	std::string correction;
+	std::vector<PolicyCheck> checks;
+};
+
+static const float enforcement_timeout = 5.0f;
+static float enforcement_interval = 5.0f;
+
+static std::vector<Policy> policies;
+static size_t enforcement_slice = 32;
+
+// Pairs visited per tick, as a multiple of the slice, so throttled pairs can't make every tick
+// walk all players and policies.
+static const size_t enforcement_visits = 4;
+static size_t enforcement_cursor = 0;
+static int32_t violation_callback = -1;
+
+static Policy *FindPolicy( const std::string &name )
+{
+	for( Policy &policy : policies )
+		if( policy.name == name )
+			return &policy;
+
+	return nullptr;
+}
+
+inline PolicyCheck &GetCheck( Policy &policy, int32_t entindex )
+{
+	const size_t index = static_cast<size_t>( entindex );
+	if( policy.checks.size( ) <= index )
+		policy.checks.resize( index + 1 );
+
+	return policy.checks[index];
+}
+
+static bool IsAllowed( const Policy &policy, const std::string &value )
+{
+	for( const std::string &allowed : policy.allowed )
+		if( allowed == value )
+			return true;
+
+	if( !policy.has_min && !policy.has_max )
+		return policy.allowed.empty( );
+
+	char *end = nullptr;
+	const float number = std::strtof( value.c_str( ), &end );
+	if( end == value.c_str( ) || *end != '\0' )
+		return false;
+
+	return ( !policy.has_min || number >= policy.min ) && ( !policy.has_max || number <= policy.max );
+}
+
+// Checks a bounded slice of player and policy pairs per tick, so the cost stays flat no matter
+// how many players are connected. The checks are asynchronous cvar queries, since most enforced
+// cvars aren't userinfo.
+static void ScheduleEnforcement( )
+{
+	const size_t players = clients.size( ) > 0 ? clients.size( ) - 1 : 0;
+	const size_t total = players * policies.size( );
+	if( total == 0 )
+		return;
+
+	const float now = global::globals->realtime;
+
+	Query query;
+	query.enforcement = true;
+	query.deadline = now + enforcement_timeout;
+
+	const size_t visits = std::min( total, enforcement_slice * enforcement_visits );
+
+	size_t scheduled = 0;
+	for( size_t k = 0; k < visits && scheduled < enforcement_slice; ++k )
+	{
+		enforcement_cursor %= total;
+		const size_t pair = enforcement_cursor++;
+		const int32_t entindex = static_cast<int32_t>( pair / policies.size( ) ) + 1;
+
+		Policy &policy = policies[pair % policies.size( )];
+		PolicyCheck &check = GetCheck( policy, entindex );
+		if( check.in_flight || now < check.next || GetClient( entindex ) == nullptr )
+			continue;
+
+		check.in_flight = true;
+		AddQuery( query, entindex, policy.name.c_str( ) );
+		++scheduled;
+	}
+
+	if( scheduled != 0 )
+		StartQuery( std::move( query ) );
+}
+
+// Corrects every violation found in a finished enforcement batch through net_SetConVar and
+// returns them, so only violations reach Lua.
+static std::vector<Violation> CheckEnforcement( const Query &query )
+{
+	const float now = global::globals->realtime;
+
+	std::vector<Violation> violations;
+	for( const QueryAnswer &answer : query.answers )
+	{
+		Policy *policy = FindPolicy( answer.name );
+		if( policy == nullptr )
+			continue;
+
+		// Corrections get the whole interval to arrive before the pair is checked again.
+		PolicyCheck &check = GetCheck( *policy, answer.entindex );
+		check.in_flight = false;
+		check.next = now + enforcement_interval;
+
+		if( !answer.answered || answer.status != eQueryCvarValueStatus_ValueIntact ||
+			IsAllowed( *policy, answer.value ) )
+			continue;
+
+		Client *client = GetClient( answer.entindex );
+		if( client != nullptr )
+			SendPairs( *client, { { policy->name.c_str( ), policy->correction.c_str( ) } }, true );
+
+		violations.push_back( { answer.entindex, answer.name, answer.value } );
+	}
+
+	return violations;
+}
+
+static void ReportViolations( GarrysMod::Lua::ILuaBase *LUA, const std::vector<Violation> &violations )
+{
+	if( violation_callback == -1 )
+		return;
+
+	for( const Violation &violation : violations )
+	{
+		LUA->ReferencePush( violation_callback );
+		LUA->PushNumber( violation.entindex );
+		LUA->PushString( violation.name.c_str( ) );
+		LUA->PushString( violation.value.c_str( ) );
+		if( LUA->PCall( 3, 0, 0 ) != 0 )
+		{
+			Warning( "[cvarsx] %s\n", LUA->GetString( -1 ) );
+			LUA->Pop( 1 );
+		}
+	}
+}
+
+static void Think( GarrysMod::Lua::ILuaBase *LUA )
+{
+	FlushQueues( );
+	DeliverQueries( LUA );
+	ScheduleEnforcement( );
+}
+
+// Collects the names from a string or a table of strings at the given stack index.
+static std::vector<std::string> CheckNames( GarrysMod::Lua::ILuaBase *LUA, int32_t index )
+{
+	std::vector<std::string> names;
+	if( LUA->IsType( index, GarrysMod::Lua::Type::STRING ) )
+	{
+		names.emplace_back( LUA->GetString( index ) );
+		return names;
+	}
+
+	LUA->CheckType( index, GarrysMod::Lua::Type::TABLE );
+
+	LUA->PushNil( );
+	while( LUA->Next( index ) != 0 )
+	{
+		if( LUA->IsType( -1, GarrysMod::Lua::Type::STRING ) )
+			names.emplace_back( LUA->GetString( -1 ) );
+
+		LUA->Pop( 1 );
+	}
+
+	return names;
+}
+
+static const float default_query_timeout = 5.0f;
+
+// Starts a query for every target and name, taking names, callback and an optional timeout
+// from the stack starting at the given index.
+static void StartQueryFromLua(
+	GarrysMod::Lua::ILuaBase *LUA,
+	int32_t first,
+	const std::vector<int32_t> &targets,
+	bool single_player
+)
+{
+	const std::vector<std::string> names = CheckNames( LUA, first );
+	LUA->CheckType( first + 1, GarrysMod::Lua::Type::FUNCTION );
+
+	float timeout = default_query_timeout;
+	if( !LUA->IsType( first + 2, GarrysMod::Lua::Type::NIL ) )
+		timeout = static_cast<float>( LUA->CheckNumber( first + 2 ) );
+
+	Query query;
+	query.single_player = single_player;
+	query.deadline = global::globals->realtime + timeout;
+	for( int32_t entindex : targets )
+		for( const std::string &name : names )
+			AddQuery( query, entindex, name.c_str( ) );
+
+	LUA->Push( first + 1 );
+	query.callback = LUA->ReferenceCreate( );
+
+	StartQuery( std::move( query ) );
+}
+
+LUA_FUNCTION_STATIC( GetConVarValue )
+{
+	LUA->CheckType( 1, GarrysMod::Lua::Type::ENTITY );
+	LUA->CheckType( 2, GarrysMod::Lua::Type::STRING );
+
+	LUA->PushString( GetUserInfo(
+		GetEntityIndex( LUA, 1 ),
+		LUA->GetString( 2 )
+	) );
+	return 1;
+}
+
+LUA_FUNCTION_STATIC( GetConVarValues )
+{
+	LUA->CheckType( 1, GarrysMod::Lua::Type::ENTITY );
+	LUA->CheckType( 2, GarrysMod::Lua::Type::TABLE );
+
+	const int32_t entindex = GetEntityIndex( LUA, 1 );
+
+	LUA->CreateTable( );
+
+	LUA->PushNil( );
+	while( LUA->Next( 2 ) != 0 )
+	{
+		if( LUA->IsType( -1, GarrysMod::Lua::Type::STRING ) )
+		{
+			const char *name = LUA->GetString( -1 );
+			LUA->Push( -1 );
+			LUA->PushString( GetUserInfo( entindex, name ) );
+			LUA->SetTable( -5 );
+		}
+
+		LUA->Pop( 1 );
+	}
+
+	return 1;
+}
+
+// Returns the tracked cvars that changed after the given tick, plus the current tick to pass next time.
+LUA_FUNCTION_STATIC( GetChangedConVars )
+{
+	LUA->CheckType( 1, GarrysMod::Lua::Type::ENTITY );
+	const int32_t since = static_cast<int32_t>( LUA->CheckNumber( 2 ) );
+
+	const int32_t entindex = GetEntityIndex( LUA, 1 );
+	Client *client = GetClient( entindex );
+	if( client == nullptr )
+		LUA->ThrowError( invalid_error );
+
+	for( const std::string &name : tracked )
+		GetUserInfo( entindex, name.c_str( ) );
+
+	LUA->CreateTable( );
+
+	for( const auto &entry : client->userinfo )
+		if( entry.second.changed > since )
+		{
+			LUA->PushString( entry.second.value.c_str( ) );
+			LUA->SetField( -2, entry.first.c_str( ) );
+		}
+
+	LUA->PushNumber( global::globals->tickcount );
+	return 2;
+}
+
+// Queries any client cvar (not only userinfo ones), calling back once with a table of
+// name -> value when all answered or the timeout (in seconds) expired.
+LUA_FUNCTION_STATIC( QueryConVarAsync )
+{
+	LUA->CheckType( 1, GarrysMod::Lua::Type::ENTITY );
+
+	const int32_t entindex = GetEntityIndex( LUA, 1 );
+	if( GetClient( entindex ) == nullptr )
+		LUA->ThrowError( invalid_error );
+
+	StartQueryFromLua( LUA, 2, { entindex }, true );
+	return 0;
+}
+
+// Values the client was already sent through this module are skipped unless forced.
+LUA_FUNCTION_STATIC( SetConVarValue )
+{
+	LUA->CheckType( 1, GarrysMod::Lua::Type::ENTITY );
+	LUA->CheckType( 2, GarrysMod::Lua::Type::STRING );
+	LUA->CheckType( 3, GarrysMod::Lua::Type::STRING );
+
+	Client *client = GetClient( GetEntityIndex( LUA, 1 ) );
+	if( client == nullptr )
+		LUA->ThrowError( invalid_error );
+
+	const Pair pair = { LUA->GetString( 2 ), LUA->GetString( 3 ) };
+	if( !IsValidPair( pair ) )
+	{
+		LUA->PushBool( false );
+		return 1;
+	}
+
+	LUA->PushBool( SendPairs( *client, { pair }, LUA->GetBool( 4 ) ) );
+	return 1;
+}
+
+// Sends every name = value pair of the table in as few net_SetConVar messages as possible,
+// skipping values the client was already sent unless forced.
+// Returns whether every message was sent and how many messages were used.
+LUA_FUNCTION_STATIC( SetConVarValues )
+{
+	LUA->CheckType( 1, GarrysMod::Lua::Type::ENTITY );
+	LUA->CheckType( 2, GarrysMod::Lua::Type::TABLE );
+
+	Client *client = GetClient( GetEntityIndex( LUA, 1 ) );
+	if( client == nullptr )
+		LUA->ThrowError( invalid_error );
+
+	bool success = true;
+	std::vector<Pair> pairs;
+	LUA->PushNil( );
+	while( LUA->Next( 2 ) != 0 )
+	{
+		if( LUA->IsType( -2, GarrysMod::Lua::Type::STRING ) &&
+			LUA->IsType( -1, GarrysMod::Lua::Type::STRING ) )
+		{
+			const Pair pair = { LUA->GetString( -2 ), LUA->GetString( -1 ) };
+			if( IsValidPair( pair ) )
+				pairs.push_back( pair );
+			else
+				success = false;
+		}
+
+		LUA->Pop( 1 );
+	}
+
+	size_t messages = 0;
+	success = SendPairs( *client, pairs, LUA->GetBool( 3 ), &messages ) && success;
+
+	LUA->PushBool( success );
+	LUA->PushNumber( static_cast<double>( messages ) );
+	return 2;
 }
 
-LUA_FUNCTION_STATIC( HasFlag )
+// Returns the last value sent to the player through this module, without asking the client.
+LUA_FUNCTION_STATIC( GetSentConVarValue )
 {
-	LUA->Push( Get( LUA, 1 )->IsFlagSet( static_cast<int32_t>( LUA->CheckNumber( 2 ) ) ) );
+	LUA->CheckType( 1, GarrysMod::Lua::Type::ENTITY );
+	const char *name = LUA->CheckString( 2 );
+
+	Client *client = GetClient( GetEntityIndex( LUA, 1 ) );
+	if( client == nullptr )
+		LUA->ThrowError( invalid_error );
+
+	auto it = client->sent.find( name );
+	if( it == client->sent.end( ) )
+		return 0;
+
+	LUA->PushString( it->second.c_str( ) );
 	return 1;
 }
 
-LUA_FUNCTION_STATIC( SetHelpText )
+LUA_FUNCTION_STATIC( GetSentConVarValues )
 {
-	Container *udata = GetUserdata( LUA, 1 );
-	ConVar *convar = udata->cvar;
-	if( convar == nullptr )
+	LUA->CheckType( 1, GarrysMod::Lua::Type::ENTITY );
+
+	Client *client = GetClient( GetEntityIndex( LUA, 1 ) );
+	if( client == nullptr )
 		LUA->ThrowError( invalid_error );
 
-	V_strncpy( udata->help, LUA->CheckString( 2 ), sizeof( udata->help ) );
-	convar->m_pszHelpString = udata->help;
+	LUA->CreateTable( );
 
-	return 0;
-}
+	for( const auto &entry : client->sent )
+	{
+		LUA->PushString( entry.second.c_str( ) );
+		LUA->SetField( -2, entry.first.c_str( ) );
+	}
 
-LUA_FUNCTION_STATIC( GetHelpText )
-{
-	LUA->PushString( Get( LUA, 1 )->GetHelpText( ) );
 	return 1;
 }
 
-LUA_FUNCTION_STATIC( Revert )
+// Queues a write that is sent on the next tick, together with every other write queued for
+// this player. Queuing the same name again in the meantime replaces the value.
+LUA_FUNCTION_STATIC( QueueConVarValue )
 {
-	Get( LUA, 1 )->Revert( );
-	return 0;
-}
+	LUA->CheckType( 1, GarrysMod::Lua::Type::ENTITY );
+	LUA->CheckType( 2, GarrysMod::Lua::Type::STRING );
+	LUA->CheckType( 3, GarrysMod::Lua::Type::STRING );
 
-LUA_FUNCTION_STATIC( GetMin )
-{
-	float min = 0.0f;
-	if( !Get( LUA, 1 )->GetMin( min ) )
-		return 0;
+	Client *client = GetClient( GetEntityIndex( LUA, 1 ) );
+	if( client == nullptr )
+		LUA->ThrowError( invalid_error );
 
-	LUA->PushNumber( min );
+	const Pair pair = { LUA->GetString( 2 ), LUA->GetString( 3 ) };
+	if( !IsValidPair( pair ) )
+	{
+		LUA->PushBool( false );
+		return 1;
+	}
+
+	client->pending[pair.name] = pair.value;
+	LUA->PushBool( true );
 	return 1;
 }
 
-LUA_FUNCTION_STATIC( SetMin )
+// Sets how many bytes of queued writes may be sent per tick, across all players.
+LUA_FUNCTION_STATIC( SetConVarQueueBudget )
 {
-	Get( LUA, 1 )->m_fMinVal = static_cast<float>( LUA->CheckNumber( 2 ) );
+	const double budget = LUA->CheckNumber( 1 );
+	if( budget < 1.0 )
+		LUA->ArgError( 1, "budget must be at least 1 byte" );
+
+	queue_budget = static_cast<size_t>( budget );
 	return 0;
 }
 
-LUA_FUNCTION_STATIC( GetMax )
+// Targets may be nil (every client), a table of players or a team index.
+// Returns a table of entity index -> whether the message was queued on that client's channel.
+// Clients that were already sent this value are skipped (and reported as successful) unless forced.
+LUA_FUNCTION_STATIC( BroadcastConVarValue )
 {
-	float max = 0.0f;
-	if( !Get( LUA, 1 )->GetMax( max ) )
-		return 0;
+	const char *name = LUA->CheckString( 1 );
+	const char *value = LUA->CheckString( 2 );
+
+	std::vector<int32_t> targets;
+	switch( LUA->GetType( 3 ) )
+	{
+		case GarrysMod::Lua::Type::NIL:
+			for( int32_t i = 1; i <= global::globals->maxClients; ++i )
+				targets.push_back( i );
+
+			break;
+
+		case GarrysMod::Lua::Type::NUMBER:
+		{
+			const int32_t team = static_cast<int32_t>( LUA->GetNumber( 3 ) );
+			for( int32_t i = 1; i <= global::globals->maxClients; ++i )
+			{
+				IPlayerInfo *info = global::playerinfo->GetPlayerInfo(
+					global::ivengine->PEntityOfEntIndex( i )
+				);
+				if( info != nullptr && info->GetTeamIndex( ) == team )
+					targets.push_back( i );
+			}
+
+			break;
+		}
+
+		case GarrysMod::Lua::Type::TABLE:
+			LUA->PushNil( );
+			while( LUA->Next( 3 ) != 0 )
+			{
+				if( LUA->IsType( -1, GarrysMod::Lua::Type::ENTITY ) )
+				{
+					targets.push_back( GetEntityIndex( LUA, -1 ) );
+				}
+
+				LUA->Pop( 1 );
+			}
+
+			break;
+
+		default:
+			LUA->ThrowError( "argument #3 is invalid (type should be nil, number or table)" );
+	}
+
+	const Pair pair = { name, value };
+	const bool force = LUA->GetBool( 4 );
+
+	Message message;
+	const bool encoded = EncodeSetConVar( message, name, value );
+
+	LUA->CreateTable( );
+
+	for( int32_t entindex : targets )
+	{
+		Client *client = GetClient( entindex );
+		if( client == nullptr )
+			continue;
+
+		bool success = true;
+		if( force || !WasSent( *client, pair ) )
+		{
+			success = encoded && Send( client->netchan, message );
+			if( success )
+				client->sent[name] = value;
+		}
+
+		LUA->PushNumber( entindex );
+		LUA->PushBool( success );
+		LUA->SetTable( -3 );
+	}
 
-	LUA->PushNumber( max );
 	return 1;
 }
 
-LUA_FUNCTION_STATIC( SetMax )
+// Queries any client cvar (not only userinfo ones) for every connected player, calling back once
+// with a table of entity index -> { name = value } when all answered or the timeout expired.
+LUA_FUNCTION_STATIC( QueryConVarAsyncForAll )
 {
-	Get( LUA, 1 )->m_fMaxVal = static_cast<float>( LUA->CheckNumber( 2 ) );
-	return 0;
-}
+	std::vector<int32_t> targets;
+	for( int32_t i = 1; i <= global::globals->maxClients; ++i )
+		if( global::ivengine->GetPlayerNetInfo( i ) != nullptr )
+			targets.push_back( i );
 
-LUA_FUNCTION_STATIC( Remove )
-{
-	CheckType( LUA, 1 );
-	global::icvar->UnregisterConCommand( Destroy( LUA, 1 ) );
+	StartQueryFromLua( LUA, 1, targets, false );
 	return 0;
 }
 
-static void Initialize( GarrysMod::Lua::ILuaBase *LUA )
+// Enforces a policy on a client cvar for every player. The policy table may contain a list of
+// allowed values ("values"), a numeric range ("min" and "max") and the value to correct
+// violations with ("correct", defaulting to the first allowed value or the range bound).
+LUA_FUNCTION_STATIC( EnforceConVar )
 {
-	LUA->CreateTable( );
-	LUA->SetField( GarrysMod::Lua::INDEX_REGISTRY, table_name );
+	Policy policy;
+	policy.name = LUA->CheckString( 1 );
+	LUA->CheckType( 2, GarrysMod::Lua::Type::TABLE );
 
-	metatype = LUA->CreateMetaTable( metaname );
+	LUA->GetField( 2, "values" );
+	if( LUA->IsType( -1, GarrysMod::Lua::Type::TABLE ) )
+	{
+		LUA->PushNil( );
+		while( LUA->Next( -2 ) != 0 )
+		{
+			if( LUA->IsType( -1, GarrysMod::Lua::Type::STRING ) )
+				policy.allowed.emplace_back( LUA->GetString( -1 ) );
+
+			LUA->Pop( 1 );
+		}
+	}
 
-	LUA->PushCFunction( gc );
-	LUA->SetField( -2, "__gc" );
+	LUA->Pop( 1 );
 
-	LUA->PushCFunction( tostring );
-	LUA->SetField( -2, "__tostring" );
+	LUA->GetField( 2, "min" );
+	if( LUA->IsType( -1, GarrysMod::Lua::Type::NUMBER ) )
+	{
+		policy.has_min = true;
+		policy.min = static_cast<float>( LUA->GetNumber( -1 ) );
+	}
 
-	LUA->PushCFunction( eq );
-	LUA->SetField( -2, "__eq" );
+	LUA->Pop( 1 );
 
-	LUA->PushCFunction( index );
-	LUA->SetField( -2, "__index" );
+	LUA->GetField( 2, "max" );
+	if( LUA->IsType( -1, GarrysMod::Lua::Type::NUMBER ) )
+	{
+		policy.has_max = true;
+		policy.max = static_cast<float>( LUA->GetNumber( -1 ) );
+	}
+
+	LUA->Pop( 1 );
+
+	LUA->GetField( 2, "correct" );
+	if( LUA->IsType( -1, GarrysMod::Lua::Type::STRING ) )
+		policy.correction = LUA->GetString( -1 );
+	else if( !policy.allowed.empty( ) )
+		policy.correction = policy.allowed.front( );
+	else if( policy.has_min || policy.has_max )
+		policy.correction = std::to_string( policy.has_min ? policy.min : policy.max );
+	else
+		LUA->ArgError( 2, "policy has no allowed values or range" );
+
+	LUA->Pop( 1 );
 
-	LUA->PushCFunction( newindex );
-	LUA->SetField( -2, "__newindex" );
+	const Pair pair = { policy.name.c_str( ), policy.correction.c_str( ) };
+	if( !IsValidPair( pair ) )
+		LUA->ArgError( 2, "name or correction value is too long" );
 
-	LUA->PushCFunction( SetValue );
-	LUA->SetField( -2, "SetValue" );
+	for( Policy &existing : policies )
+		if( existing.name == policy.name )
+		{
+			policy.checks = std::move( existing.checks );
+			existing = std::move( policy );
+			return 0;
+		}
 
-	LUA->PushCFunction( GetBool );
-	LUA->SetField( -2, "GetBool" );
+	policies.push_back( std::move( policy ) );
+	return 0;
+}
 
-	LUA->PushCFunction( GetDefault );
-	LUA->SetField( -2, "GetDefault" );
+LUA_FUNCTION_STATIC( UnenforceConVar )
+{
+	const std::string name = LUA->CheckString( 1 );
+	policies.erase( std::remove_if( policies.begin( ), policies.end( ), [&name]( const Policy &policy )
+	{
+		return policy.name == name;
+	} ), policies.end( ) );
+	return 0;
+}
 
-	LUA->PushCFunction( GetFloat );
-	LUA->SetField( -2, "GetFloat" );
+// Sets how many player and cvar pairs are checked per tick. At most four times as many pairs
+// are looked at per tick to find them.
+LUA_FUNCTION_STATIC( SetEnforcementSlice )
+{
+	const double slice = LUA->CheckNumber( 1 );
+	if( slice < 1.0 )
+		LUA->ArgError( 1, "slice must be at least 1" );
 
-	LUA->PushCFunction( GetInt );
-	LUA->SetField( -2, "GetInt" );
+	enforcement_slice = static_cast<size_t>( slice );
+	return 0;
+}
 
-	LUA->PushCFunction( GetName );
-	LUA->SetField( -2, "GetName" );
+// Sets the minimum amount of seconds between two checks of the same player and cvar pair.
+LUA_FUNCTION_STATIC( SetEnforcementInterval )
+{
+	const double interval = LUA->CheckNumber( 1 );
+	if( interval < 0.0 )
+		LUA->ArgError( 1, "interval must not be negative" );
 
-	LUA->PushCFunction( SetName );
-	LUA->SetField( -2, "SetName" );
+	enforcement_interval = static_cast<float>( interval );
+	return 0;
+}
 
-	LUA->PushCFunction( GetString );
-	LUA->SetField( -2, "GetString" );
+// The callback receives the entity index, cvar name and offending value of every violation,
+// after it was corrected. Pass nil to stop reporting.
+LUA_FUNCTION_STATIC( SetViolationCallback )
+{
+	if( !LUA->IsType( 1, GarrysMod::Lua::Type::NIL ) )
+		LUA->CheckType( 1, GarrysMod::Lua::Type::FUNCTION );
 
-	LUA->PushCFunction( SetFlags );
-	LUA->SetField( -2, "SetFlags" );
+	if( violation_callback != -1 )
+	{
+		LUA->ReferenceFree( violation_callback );
+		violation_callback = -1;
+	}
 
-	LUA->PushCFunction( GetFlags );
-	LUA->SetField( -2, "GetFlags" );
+	if( LUA->IsType( 1, GarrysMod::Lua::Type::FUNCTION ) )
+	{
+		LUA->Push( 1 );
+		violation_callback = LUA->ReferenceCreate( );
+	}
 
-	LUA->PushCFunction( HasFlag );
-	LUA->SetField( -2, "HasFlag" );
+	return 0;
+}
 
-	LUA->PushCFunction( SetHelpText );
-	LUA->SetField( -2, "SetHelpText" );
+// Gathers a userinfo cvar of every connected client into a column (served from the cache for
+// tracked cvars), without creating a Lua string per player.
+static std::vector<const char *> GatherColumn( const char *name )
+{
+	std::vector<const char *> column;
+	for( int32_t i = 1; i <= global::globals->maxClients; ++i )
+		if( GetClient( i ) != nullptr )
+			column.push_back( GetUserInfo( i, name ) );
 
-	LUA->PushCFunction( GetHelpText );
-	LUA->SetField( -2, "GetHelpText" );
+	return column;
+}
 
-	LUA->PushCFunction( Revert );
-	LUA->SetField( -2, "Revert" );
+// Aggregates a client cvar across every connected player:
+//   "histogram"       returns a table of value -> amount of players
+//   "count", value    returns the amount of players with that value
+//   "stats"           returns min, max, mean and amount of the players with numeric values
+LUA_FUNCTION_STATIC( AggregateConVar )
+{
+	const char *name = LUA->CheckString( 1 );
+	const std::string mode = LUA->CheckString( 2 );
 
-	LUA->PushCFunction( GetMin );
-	LUA->SetField( -2, "GetMin" );
+	const std::vector<const char *> column = GatherColumn( name );
 
-	LUA->PushCFunction( SetMin );
-	LUA->SetField( -2, "SetMin" );
+	if( mode == "histogram" )
+	{
+		std::unordered_map<std::string, size_t> histogram;
+		for( const char *value : column )
+			++histogram[value];
 
-	LUA->PushCFunction( GetMax );
-	LUA->SetField( -2, "GetMax" );
+		LUA->CreateTable( );
+		for( const auto &entry : histogram )
+		{
+			LUA->PushNumber( static_cast<double>( entry.second ) );
+			LUA->SetField( -2, entry.first.c_str( ) );
+		}
 
-	LUA->PushCFunction( SetMax );
-	LUA->SetField( -2, "SetMax" );
+		return 1;
+	}
+	else if( mode == "count" )
+	{
+		const char *expected = LUA->CheckString( 3 );
 
-	LUA->PushCFunction( Remove );
-	LUA->SetField( -2, "Remove" );
+		size_t count = 0;
+		for( const char *value : column )
+			if( std::strcmp( value, expected ) == 0 )
+				++count;
 
-	LUA->Pop( 1 );
-}
+		LUA->PushNumber( static_cast<double>( count ) );
+		return 1;
+	}
+	else if( mode == "stats" )
+	{
+		size_t count = 0;
+		double min = 0.0, max = 0.0, sum = 0.0;
+		for( const char *value : column )
+		{
+			char *end = nullptr;
+			const double number = std::strtod( value, &end );
+			if( end == value || *end != '\0' )
+				continue;
+
+			min = count == 0 || number < min ? number : min;
+			max = count == 0 || number > max ? number : max;
+			sum += number;
+			++count;
+		}
 
-static void Deinitialize( GarrysMod::Lua::ILuaBase *LUA )
-{
-	LUA->PushNil( );
-	LUA->SetField( GarrysMod::Lua::INDEX_REGISTRY, metaname );
+		if( count == 0 )
+		{
+			LUA->PushNil( );
+			LUA->PushNil( );
+			LUA->PushNil( );
+		}
+		else
+		{
+			LUA->PushNumber( min );
+			LUA->PushNumber( max );
+			LUA->PushNumber( sum / count );
+		}
 
-	LUA->PushNil( );
-	LUA->SetField( GarrysMod::Lua::INDEX_REGISTRY, table_name );
-}
+		LUA->PushNumber( static_cast<double>( count ) );
+		return 4;
+	}
 
+	LUA->ArgError( 2, "mode should be \"histogram\", \"count\" or \"stats\"" );
+	return 0;
 }
 
-namespace cvars
+// Tracked userinfo cvars are cached per player and refreshed when the client reports changes.
+LUA_FUNCTION_STATIC( TrackConVar )
 {
+	const char *name = LUA->CheckString( 1 );
+	if( !tracked.insert( name ).second )
+		return 0;
 
-static const char *table_name = "cvars";
+	for( int32_t i = 1; i <= global::globals->maxClients; ++i )
+		GetUserInfo( i, name );
 
-LUA_FUNCTION_STATIC( Exists )
+	return 0;
+}
+
+LUA_FUNCTION_STATIC( UntrackConVar )
 {
-	LUA->CheckType( 1, GarrysMod::Lua::Type::STRING );
+	const std::string name = LUA->CheckString( 1 );
+	if( tracked.erase( name ) == 0 )
+		return 0;
 
-	ConVar *convar = global::icvar->FindVar( LUA->GetString( 1 ) );
-	if( convar == nullptr )
-		LUA->PushBool( false );
-	else
-		LUA->PushBool( !convar->IsCommand( ) );
+	for( Client &client : clients )
+		client.userinfo.erase( name );
 
-	return 1;
+	return 0;
 }
 
-LUA_FUNCTION_STATIC( GetAll )
+// Returns a table of entity index -> value for every connected client.
+LUA_FUNCTION_STATIC( GetConVarValueForAll )
 {
+	const char *name = LUA->CheckString( 1 );
+
 	LUA->CreateTable( );
 
-	size_t i = 0;
-	ICvar::Iterator iter( global::icvar ); 
-	for( iter.SetFirst( ); iter.IsValid( ); iter.Next( ) )
-	{  
-		ConVar *convar = static_cast<ConVar *>( iter.Get( ) );
-		if( !convar->IsCommand( ) )
-		{
-			convar::Push( LUA, convar );
-			LUA->PushNumber( ++i );
-			LUA->SetTable( -3 );
-		}
+	for( int32_t i = 1; i <= global::globals->maxClients; ++i )
+	{
+		if( global::ivengine->GetPlayerNetInfo( i ) == nullptr )
+			continue;
+
+		LUA->PushNumber( i );
+		LUA->PushString( GetUserInfo( i, name ) );
+		LUA->SetTable( -3 );
 	}
 
 	return 1;
 }
 
-LUA_FUNCTION_STATIC( Get )
-{
-	convar::Push( LUA, global::icvar->FindVar( LUA->CheckString( 1 ) ) );
-	return 1;
-}
+static const binding::Function methods[] = {
+	{ "GetConVarValue", GetConVarValue },
+	{ "GetConVarValues", GetConVarValues },
+	{ "GetChangedConVars", GetChangedConVars },
+	{ "QueryConVarAsync", QueryConVarAsync },
+	{ "SetConVarValue", SetConVarValue },
+	{ "SetConVarValues", SetConVarValues },
+	{ "QueueConVarValue", QueueConVarValue },
+	{ "GetSentConVarValue", GetSentConVarValue },
+	{ "GetSentConVarValues", GetSentConVarValues }
+};
+
+static const binding::Function functions[] = {
+	{ "GetConVarValueForAll", GetConVarValueForAll },
+	{ "BroadcastConVarValue", BroadcastConVarValue },
+	{ "SetConVarQueueBudget", SetConVarQueueBudget },
+	{ "TrackConVar", TrackConVar },
+	{ "AggregateConVar", AggregateConVar },
+	{ "UntrackConVar", UntrackConVar },
+	{ "QueryConVarAsync", QueryConVarAsyncForAll },
+	{ "EnforceConVar", EnforceConVar },
+	{ "UnenforceConVar", UnenforceConVar },
+	{ "SetEnforcementSlice", SetEnforcementSlice },
+	{ "SetEnforcementInterval", SetEnforcementInterval },
+	{ "SetConVarViolationCallback", SetViolationCallback }
+};
 
 static void Initialize( GarrysMod::Lua::ILuaBase *LUA )
 {
-	LUA->GetField( GarrysMod::Lua::INDEX_GLOBAL, table_name );
+	clients.resize( static_cast<size_t>( global::globals->maxClients ) + 1 );
+
+	IServerGameClients *gameclients = global::server_loader.GetInterface<IServerGameClients>(
+		INTERFACEVERSION_SERVERGAMECLIENTS
+	);
+	if( gameclients == nullptr )
+		LUA->ThrowError( "IServerGameClients not initialized. Critical error." );
 
-	LUA->PushCFunction( Exists );
-	LUA->SetField( -2, "Exists" );
+	gameclients_proxy = new ServerGameClientsProxy( gameclients );
 
-	LUA->PushCFunction( GetAll );
-	LUA->SetField( -2, "GetAll" );
+	IServerGameDLL *gamedll = global::server_loader.GetInterface<IServerGameDLL>(
+		INTERFACEVERSION_SERVERGAMEDLL
+	);
+	if( gamedll == nullptr )
+		LUA->ThrowError( "IServerGameDLL not initialized. Critical error." );
 
-	LUA->PushCFunction( Get );
-	LUA->SetField( -2, "Get" );
+	gamedll_proxy = new ServerGameDLLProxy( gamedll );
 
+	LUA->GetField( GarrysMod::Lua::INDEX_REGISTRY, "Player" );
+	binding::Register( LUA, methods );
+	LUA->Pop( 1 );
+
+	LUA->GetField( GarrysMod::Lua::INDEX_GLOBAL, "player" );
+	binding::Register( LUA, functions );
 	LUA->Pop( 1 );
 }
 
 static void Deinitialize( GarrysMod::Lua::ILuaBase *LUA )
 {
-	LUA->GetField( GarrysMod::Lua::INDEX_GLOBAL, table_name );
-
-	LUA->PushNil( );
-	LUA->SetField( -2, "Exists" );
+	LUA->GetField( GarrysMod::Lua::INDEX_REGISTRY, "Player" );
+	binding::Unregister( LUA, methods );
+	LUA->Pop( 1 );
 
-	LUA->PushNil( );
-	LUA->SetField( -2, "GetAll" );
+	LUA->GetField( GarrysMod::Lua::INDEX_GLOBAL, "player" );
+	binding::Unregister( LUA, functions );
+	LUA->Pop( 1 );
 
-	LUA->PushNil( );
-	LUA->SetField( -2, "Get" );
+	delete gameclients_proxy;
+	gameclients_proxy = nullptr;
 
-	LUA->Pop( 1 );
-}
+	delete gamedll_proxy;
+	gamedll_proxy = nullptr;
 
-}
+	for( const auto &entry : queries )
+		if( entry.second.callback != -1 )
+			LUA->ReferenceFree( entry.second.callback );
 
-#if defined CVARSX_SERVER
+	queries.clear( );
+	cookies.clear( );
 
-namespace Player
-{
+	if( violation_callback != -1 )
+	{
+		LUA->ReferenceFree( violation_callback );
+		violation_callback = -1;
+	}
 
-static const char *invalid_error = "invalid Player";
+	policies.clear( );
+	enforcement_cursor = 0;
 
-inline int GetEntityIndex( GarrysMod::Lua::ILuaBase *LUA, int i )
-{
-	LUA->Push( i );
-	LUA->GetField( -1, "EntIndex" );
-	LUA->Push( -2 );
-	LUA->Call( 1, 1 );
+	clients.clear( );
+	tracked.clear( );
+}
 
-	return static_cast<int32_t>( LUA->GetNumber( -1 ) );
 }
 
-LUA_FUNCTION_STATIC( GetConVarValue )
+#endif
+
+namespace tick
 {
-	LUA->CheckType( 1, GarrysMod::Lua::Type::ENTITY );
-	LUA->CheckType( 2, GarrysMod::Lua::Type::STRING );
 
-	LUA->PushString( global::ivengine->GetClientConVarValue(
-		GetEntityIndex( LUA, 1 ),
-		LUA->GetString( 2 )
-	) );
-	return 1;
-}
+static const char hook_name[] = "cvarsx";
 
-LUA_FUNCTION_STATIC( SetConVarValue )
+LUA_FUNCTION_STATIC( Think )
 {
-	LUA->CheckType( 1, GarrysMod::Lua::Type::ENTITY );
-	LUA->CheckType( 2, GarrysMod::Lua::Type::STRING );
-	LUA->CheckType( 3, GarrysMod::Lua::Type::STRING );
+	watch::ReleaseOrphans( LUA );
 
-	INetChannel *netchan = static_cast<INetChannel *>( global::ivengine->GetPlayerNetInfo(
-		GetEntityIndex( LUA, 1 )
-	) );
-	if( netchan == nullptr )
-		LUA->ThrowError( invalid_error );
+	if( !changes::pending.empty( ) )
+	{
+		const std::unordered_map<ConVar *, changes::Change> pending = changes::Take( );
+		cvars::UpdateMirrors( LUA, pending );
+		watch::Think( LUA, pending );
+	}
 
-	char buffer[2 + 260 + 260] = { 0 };
-	bf_write packet( buffer, sizeof( buffer ) );
-	packet.SetAssertOnOverflow( false );
+#if defined CVARSX_SERVER
 
-	packet.WriteUBitLong( 5, 6 );
-	packet.WriteByte( 0x01 );
-	packet.WriteString( LUA->GetString( 2 ) );
-	packet.WriteString( LUA->GetString( 3 ) );
+	Player::Think( LUA );
 
-	LUA->PushBool( !packet.IsOverflowed( ) ? netchan->SendData( packet ) : false );
-	return 1;
+#endif
+
+	return 0;
 }
 
 static void Initialize( GarrysMod::Lua::ILuaBase *LUA )
 {
-	LUA->GetField( GarrysMod::Lua::INDEX_REGISTRY, "Player" );
-
-	LUA->PushCFunction( GetConVarValue );
-	LUA->SetField( -2, "GetConVarValue" );
-
-	LUA->PushCFunction( SetConVarValue );
-	LUA->SetField( -2, "SetConVarValue" );
-
+	LUA->GetField( GarrysMod::Lua::INDEX_GLOBAL, "hook" );
+	LUA->GetField( -1, "Add" );
+	LUA->PushString( "Tick" );
+	LUA->PushString( hook_name );
+	LUA->PushCFunction( Think );
+	LUA->Call( 3, 0 );
 	LUA->Pop( 1 );
 }
 
 static void Deinitialize( GarrysMod::Lua::ILuaBase *LUA )
 {
-
-	LUA->GetField( GarrysMod::Lua::INDEX_REGISTRY, "Player" );
-
-	LUA->PushNil( );
-	LUA->SetField( -2, "GetConVarValue" );
-
-	LUA->PushNil( );
-	LUA->SetField( -2, "SetConVarValue" );
-
+	LUA->GetField( GarrysMod::Lua::INDEX_GLOBAL, "hook" );
+	LUA->GetField( -1, "Remove" );
+	LUA->PushString( "Tick" );
+	LUA->PushString( hook_name );
+	LUA->Call( 2, 0 );
 	LUA->Pop( 1 );
 }
 
 }
 
-#endif
-
 GMOD_MODULE_OPEN( )
 {
 	global::Initialize( LUA );
+	changes::Initialize( );
 	cvars::Initialize( LUA );
 	convar::Initialize( LUA );
+	watch::Initialize( LUA );
+	snapshot::Initialize( LUA );
+	state::Initialize( LUA );
 
 #if defined CVARSX_SERVER
 
@@ -617,11 +4153,13 @@ GMOD_MODULE_OPEN( )
 
 #endif
 
+	tick::Initialize( LUA );
 	return 0;
 }
 
 GMOD_MODULE_CLOSE( )
 {
+	tick::Deinitialize( LUA );
 
 #if defined CVARSX_SERVER
 
@@ -629,7 +4167,12 @@ GMOD_MODULE_CLOSE( )
 
 #endif
 
+	state::Deinitialize( LUA );
+	snapshot::Deinitialize( LUA );
+	watch::Deinitialize( LUA );
 	convar::Deinitialize( LUA );
 	cvars::Deinitialize( LUA );
+	changes::Deinitialize( );
+	global::Deinitialize( LUA );
 	return 0;
 }
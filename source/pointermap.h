@@ -0,0 +1,135 @@
+#ifndef POINTERMAP_H
+#define POINTERMAP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Open addressing hash map keyed by non-null pointers. Uses linear probing and backward shift
+// deletion, so lookups never have to skip over tombstones.
+template<typename Key, typename Value>
+class PointerMap
+{
+public:
+	Value *Find( const Key *key )
+	{
+		if( count == 0 )
+			return nullptr;
+
+		for( size_t i = Index( key ); ; i = ( i + 1 ) & mask )
+		{
+			Slot &slot = slots[i];
+			if( slot.key == key )
+				return &slot.value;
+
+			if( slot.key == nullptr )
+				return nullptr;
+		}
+	}
+
+	Value &Insert( const Key *key, const Value &value )
+	{
+		if( ( count + 1 ) * 4 > slots.size( ) * 3 )
+			Grow( );
+
+		for( size_t i = Index( key ); ; i = ( i + 1 ) & mask )
+		{
+			Slot &slot = slots[i];
+			if( slot.key == nullptr )
+			{
+				slot.key = key;
+				++count;
+			}
+			else if( slot.key != key )
+			{
+				continue;
+			}
+
+			slot.value = value;
+			return slot.value;
+		}
+	}
+
+	bool Erase( const Key *key )
+	{
+		if( count == 0 )
+			return false;
+
+		size_t hole = Index( key );
+		while( slots[hole].key != key )
+		{
+			if( slots[hole].key == nullptr )
+				return false;
+
+			hole = ( hole + 1 ) & mask;
+		}
+
+		// Pull back every following entry of the cluster that is allowed to live in the hole.
+		for( size_t i = ( hole + 1 ) & mask; slots[i].key != nullptr; i = ( i + 1 ) & mask )
+		{
+			const size_t ideal = Index( slots[i].key );
+			if( ( ( i - ideal ) & mask ) >= ( ( i - hole ) & mask ) )
+			{
+				slots[hole] = slots[i];
+				hole = i;
+			}
+		}
+
+		slots[hole] = Slot( );
+		--count;
+		return true;
+	}
+
+	template<typename Callback>
+	void ForEach( Callback callback )
+	{
+		for( Slot &slot : slots )
+			if( slot.key != nullptr )
+				callback( slot.key, slot.value );
+	}
+
+	void Clear( )
+	{
+		slots.clear( );
+		mask = 0;
+		count = 0;
+	}
+
+	size_t Size( ) const
+	{
+		return count;
+	}
+
+private:
+	struct Slot
+	{
+		const Key *key = nullptr;
+		Value value = Value( );
+	};
+
+	size_t Index( const Key *key ) const
+	{
+		uint64_t hash = static_cast<uint64_t>( reinterpret_cast<uintptr_t>( key ) );
+		hash ^= hash >> 29;
+		hash *= 0x9E3779B97F4A7C15ull;
+		return static_cast<size_t>( hash >> 32 ) & mask;
+	}
+
+	void Grow( )
+	{
+		std::vector<Slot> previous( slots.size( ) < 16 ? 16 : slots.size( ) * 2 );
+		previous.swap( slots );
+		mask = slots.size( ) - 1;
+		count = 0;
+
+		for( const Slot &slot : previous )
+			if( slot.key != nullptr )
+				Insert( slot.key, slot.value );
+	}
+
+	std::vector<Slot> slots;
+	size_t mask = 0;
+	size_t count = 0;
+};
+
+#endif // POINTERMAP_H